@@ -1,12 +1,25 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <time.h>
 #include <SDL.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// avx2 paths are compiled per function and picked at run time
+#include <immintrin.h>
+#define HAVE_AVX2_PATHS
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 // forward decl
+struct map;
 void handle_game_over_state(const SDL_Event* ev);
+size_t path_pool_memory(const struct map* m);
+void flush_sprites();
 
 // TODO tile-size should be variable
 const int TILE_WIDTH = 10;
@@ -15,23 +28,39 @@ const int TILE_HEIGHT = 10;
 const int ZOOMX = 1;
 const int ZOOMY = 1;
 
+// size of the map view, and of the default level
 #define COLS  80
 #define ROWS  45
 
+// largest level side: tile indices are ints, and width * height stays
+// far below INT_MAX / 64 so that per tile sizes in bits and the path
+// node arrays do not overflow
+#define MAX_LEVEL_SIDE 4096
+
 #define SCREEN_COLS ((COLS)+0)
 #define SCREEN_ROWS ((ROWS)+5)
 
 #define WINDOW_WIDTH    ((TILE_WIDTH) * (ZOOMX) * (SCREEN_COLS))
 #define WINDOW_HEIGHT   ((TILE_HEIGHT) * (ZOOMY) * (SCREEN_ROWS))
 
+#define MAP_LAYER_WIDTH     ((TILE_WIDTH) * (ZOOMX) * (COLS))
+#define MAP_LAYER_HEIGHT    ((TILE_HEIGHT) * (ZOOMY) * (ROWS))
+
 #define MAX_ROOMS_PER_MAP   30
 #define VIEW_RADIUS         10
 
 #define MAX_ACTORS 128
+
+// find_path and the player distance map each keep a pool of the level size
+#define GAME_PATH_POOLS 2
 #define MAX_CORPSES MAX_ACTORS
 
+#define FPS_CAP             60
+#define STATS_INTERVAL_MS   1000
+
 #define MAX_MESSAGE_LEN 256
-#define MAX_MESSAGES_IN_LOG 128
+#define MAX_MESSAGES_IN_LOG 256
+#define MAX_MESSAGE_ARGS 3
 
 struct action {
 	int param1;
@@ -90,6 +119,19 @@ enum game_state {
 	GAME_STATE_HISTORY_VIEWER
 };
 
+enum frame_policy {
+	FRAME_POLICY_EVENT_DRIVEN,
+	FRAME_POLICY_VSYNC,
+	FRAME_POLICY_FPS_CAP,
+	NUM_FRAME_POLICIES
+};
+
+const char* frame_policy_names[NUM_FRAME_POLICIES] = {
+	"event",
+	"vsync",
+	"capped"
+};
+
 struct global {
 	SDL_Window* window;
 	SDL_Renderer* renderer;
@@ -99,11 +141,22 @@ struct global {
 	bool focus;
 	int mouse_x;
 	int mouse_y;
+	int camera_x; // map tile shown in the top left corner of the view
+	int camera_y;
 	Uint64 start_ticks;
 	Uint64 last_ticks;
+	SDL_Texture* map_layer;
+	bool map_dirty;
+	enum frame_policy frame_policy;
+	bool redraw;
+	bool show_profiler;
+	Uint64 input_ticks; // event dispatch since the last frame
 };
 
-static int32_t SDL_USEREVENT_NOTHING, SDL_USEREVENT_RENDER;
+static int32_t SDL_USEREVENT_RENDER;
+#ifndef ROQUEST_HEADLESS
+static int32_t SDL_USEREVENT_NOTHING;
+#endif
 
 struct global g;
 
@@ -114,14 +167,32 @@ enum tile_type {
 };
 
 struct map_tile {
-	struct {
-		int visible : 1;
-		int explored : 1;
-	};
-	enum tile_type type;
+	uint8_t type; // enum tile_type
+};
+
+// a level of runtime size: the tiles and the per tile grids derived from
+// them, all row-major (index y * width + x)
+struct map {
+	int width, height;
+	struct map_tile* tiles;
+	// bitplanes, stride words of 64 tiles per row
+	int stride;
+	uint64_t* visible;
+	uint64_t* explored;
+	uint64_t* walkable;    // built from the tile types when the level is connected
+	uint64_t* transparent; // built from the tile types when the level is connected
+	// occupancy grid: index of the first living actor and of the first
+	// corpse per tile, further actors on the same tile are chained through
+	// actor.next
+	int16_t* alive_at;
+	int16_t* corpse_at;
+	// origin of the last fov, only tiles around it can be visible
+	int fov_x, fov_y;
 };
 
-static struct map_tile map[ROWS][COLS];
+// the level being played
+static struct map* level;
+static int level_width = COLS, level_height = ROWS;
 
 enum render_order {
 	RENDER_ORDER_CORPSE,
@@ -157,32 +228,344 @@ struct actor {
 	int x, y;
 	bool alive;
 	int hp;
+	int16_t next; // next actor on the same tile and layer
 };
 
 // ent #0 is player
 static struct actor actors[MAX_ACTORS];
 static int num_actors;
 
+#define NO_ACTOR -1
+
+// messages are stored as template id and arguments and only formatted
+// when they are drawn
+enum message_id {
+	MESSAGE_WELCOME,
+	MESSAGE_ATTACK,
+	MESSAGE_ATTACK_NO_DAMAGE,
+	MESSAGE_PLAYER_DIED,
+	MESSAGE_ACTOR_DIED,
+	NUM_MESSAGE_IDS
+};
+
+enum message_arg {
+	MESSAGE_ARG_NONE,
+	MESSAGE_ARG_NAME,       // enum actor_type, catalog name
+	MESSAGE_ARG_NAME_UPPER, // enum actor_type, catalog name in upper case
+	MESSAGE_ARG_INT
+};
+
+struct message_template {
+	const char* format; // every % conversion takes the next argument
+	uint8_t args[MAX_MESSAGE_ARGS];
+};
+
+// order must be same as message_id!
+const struct message_template message_templates[NUM_MESSAGE_IDS] = {
+	{ "Hello and welcome, adventurer, to yet another dungeon!" },
+	{ "%s attacks %s for %d hit points.", { MESSAGE_ARG_NAME_UPPER, MESSAGE_ARG_NAME, MESSAGE_ARG_INT } },
+	{ "%s attacks %s but does no damage.", { MESSAGE_ARG_NAME_UPPER, MESSAGE_ARG_NAME } },
+	{ "You died!" },
+	{ "%s is dead!", { MESSAGE_ARG_NAME } }
+};
+
 struct message {
-	char text[MAX_MESSAGE_LEN];
+	uint8_t id;
 	struct color fg;
+	int32_t args[MAX_MESSAGE_ARGS];
+	uint32_t hash;   // of id and arguments
+	uint32_t serial; // identifies the message in the wrap cache
 	int count;
 };
 
 static struct message messages[MAX_MESSAGES_IN_LOG];
 static int last_message;
 static int num_messages;
+static uint32_t message_serial;
+
+// a message wraps into at most this many lines, any further are dropped
+#define MAX_WRAP_LINES 32
+
+// line breaks of the recently drawn messages, direct mapped by serial and
+// width, a power of two above the messages of a history page. the text is
+// not kept, formatting is cheap next to wrapping
+#define WRAP_CACHE_SIZE 128
+
+// formatted text of a message with its stack count fits into this
+#define MAX_FORMATTED_LEN (MAX_MESSAGE_LEN + 16)
+
+struct wrap_entry {
+	uint32_t serial;
+	int width;
+	int count;
+	int num_lines;
+	uint16_t line_start[MAX_WRAP_LINES + 1];
+};
+
+static struct wrap_entry wrap_cache[WRAP_CACHE_SIZE];
 
 int maxi(int a, int b) { return a >= b ? a : b; }
 int mini(int a, int b) { return a <= b ? a : b; }
 
-void dump_map()
+// profiler: the last PROFILE_HISTORY samples (performance counter ticks) of
+// every frame and turn phase
+enum profile_phase {
+	PHASE_INPUT,   // event dispatch without the turns it triggers
+	PHASE_ACTION,  // player action
+	PHASE_AI,      // monster ai without pathfinding
+	PHASE_PATH,    // player distance map
+	PHASE_FOV,
+	PHASE_BUILD,   // cell encoding and vertex building
+	PHASE_SUBMIT,  // geometry and background submission
+	PHASE_PRESENT,
+	NUM_PROFILE_PHASES
+};
+
+const char* profile_phase_names[NUM_PROFILE_PHASES] = {
+	"input",
+	"action",
+	"ai",
+	"path",
+	"fov",
+	"build",
+	"submit",
+	"present"
+};
+
+#define PROFILE_HISTORY 512
+
+struct profile_ring {
+	Uint64 ticks[PROFILE_HISTORY];
+	uint32_t count; // samples recorded in total
+};
+
+static struct profile_ring profile[NUM_PROFILE_PHASES];
+
+void profile_record(enum profile_phase phase, Uint64 ticks)
+{
+	struct profile_ring* r = &profile[phase];
+	r->ticks[r->count++ % PROFILE_HISTORY] = ticks;
+}
+
+int compare_ticks(const void* a, const void* b)
+{
+	Uint64 ta = *(const Uint64*)a, tb = *(const Uint64*)b;
+	return ta < tb ? -1 : ta > tb;
+}
+
+// p50, p95 and p99 of the samples in the history of a phase
+int profile_percentiles(enum profile_phase phase, Uint64 res[3])
+{
+	struct profile_ring* r = &profile[phase];
+	int n = r->count < PROFILE_HISTORY ? (int)r->count : PROFILE_HISTORY;
+	if (n == 0)
+		return 0;
+
+	Uint64 sorted[PROFILE_HISTORY];
+	memcpy(sorted, r->ticks, n * sizeof(Uint64));
+	qsort(sorted, n, sizeof(Uint64), compare_ticks);
+	res[0] = sorted[n / 2];
+	res[1] = sorted[mini(n - 1, n * 95 / 100)];
+	res[2] = sorted[mini(n - 1, n * 99 / 100)];
+	return n;
+}
+
+// tracing: spans written as chrome trace_event json (chrome://tracing,
+// perfetto). The producing thread only stores into a lock-free single
+// producer/single consumer ring, a background thread formats and writes
+// the events. The game only traces on the main thread, so there is one ring.
+#define TRACE_RING_SIZE 0x10000
+
+struct trace_event {
+	const char* name;
+	Uint64 begin, end;
+};
+
+struct trace_ring {
+	struct trace_event events[TRACE_RING_SIZE];
+	SDL_atomic_t head; // next event to write, producer only
+	SDL_atomic_t tail; // next event to flush, flush thread only
+	SDL_threadID thread;
+	uint32_t dropped;  // events lost to a full ring
+};
+
+struct trace {
+	bool enabled;
+	SDL_RWops* file;
+	SDL_Thread* thread;
+	SDL_sem* wake;
+	SDL_atomic_t stop;
+	Uint64 start;
+	uint64_t written;
+	struct trace_ring ring;
+};
+
+static struct trace trace;
+
+static inline Uint64 trace_begin()
+{
+	return trace.enabled ? SDL_GetPerformanceCounter() : 0;
+}
+
+static inline void trace_end(const char* name, Uint64 begin)
+{
+	if (!trace.enabled)
+		return;
+
+	struct trace_ring* r = &trace.ring;
+	SDL_assert(SDL_ThreadID() == r->thread);
+	int head = SDL_AtomicGet(&r->head);
+	if (head - SDL_AtomicGet(&r->tail) == TRACE_RING_SIZE) {
+		r->dropped++;
+		return;
+	}
+	r->events[head & (TRACE_RING_SIZE - 1)] = (struct trace_event){ name, begin, SDL_GetPerformanceCounter() };
+	SDL_AtomicSet(&r->head, head + 1);
+}
+
+// writes all events of the ring, returns false if nothing was pending
+bool trace_drain()
+{
+	struct trace_ring* r = &trace.ring;
+	int tail = SDL_AtomicGet(&r->tail);
+	int head = SDL_AtomicGet(&r->head);
+	if (tail == head)
+		return false;
+
+	double us = 1000000.0 / SDL_GetPerformanceFrequency();
+	char buffer[0x4000];
+	int len = 0;
+	for (; tail != head; tail++) {
+		struct trace_event* e = &r->events[tail & (TRACE_RING_SIZE - 1)];
+		len += SDL_snprintf(buffer + len, sizeof(buffer) - len,
+			",\n{\"name\":\"%s\",\"cat\":\"roquest\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%lu}",
+			e->name, (e->begin - trace.start) * us, (e->end - e->begin) * us, (unsigned long)r->thread);
+		if (len > (int)sizeof(buffer) - 256) {
+			SDL_RWwrite(trace.file, buffer, 1, len);
+			len = 0;
+		}
+		trace.written++;
+	}
+	SDL_RWwrite(trace.file, buffer, 1, len);
+	// the slots may be reused only after they were formatted
+	SDL_AtomicSet(&r->tail, tail);
+	return true;
+}
+
+int trace_thread(void* udata)
+{
+	while (!SDL_AtomicGet(&trace.stop)) {
+		if (!trace_drain())
+			SDL_SemWaitTimeout(trace.wake, 10);
+	}
+	trace_drain();
+	return 0;
+}
+
+void trace_start(const char* path)
+{
+	trace.file = SDL_RWFromFile(path, "w");
+	if (!trace.file) {
+		SDL_Log("could not write trace '%s': %s", path, SDL_GetError());
+		return;
+	}
+
+	// the process and thread names are metadata events, every span appends
+	// itself with a leading comma
+	char header[256];
+	int len = SDL_snprintf(header, sizeof(header),
+		"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+		"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"main\"}}",
+		(unsigned long)SDL_ThreadID());
+	SDL_RWwrite(trace.file, header, 1, len);
+
+	trace.ring.thread = SDL_ThreadID();
+	trace.start = SDL_GetPerformanceCounter();
+	trace.wake = SDL_CreateSemaphore(0);
+	trace.thread = SDL_CreateThread(trace_thread, "trace", NULL);
+	if (!trace.wake || !trace.thread) {
+		SDL_Log("could not start trace thread: %s", SDL_GetError());
+		SDL_RWclose(trace.file);
+		return;
+	}
+	trace.enabled = true;
+	SDL_Log("tracing to '%s'", path);
+}
+
+void trace_stop()
+{
+	if (!trace.enabled)
+		return;
+
+	trace.enabled = false;
+	SDL_AtomicSet(&trace.stop, 1);
+	SDL_SemPost(trace.wake);
+	SDL_WaitThread(trace.thread, NULL);
+	SDL_DestroySemaphore(trace.wake);
+
+	const char* footer = "\n]}\n";
+	SDL_RWwrite(trace.file, footer, 1, strlen(footer));
+	SDL_RWclose(trace.file);
+	SDL_Log("trace: %llu events written, %u dropped", (unsigned long long)trace.written, trace.ring.dropped);
+}
+
+static inline int map_index(const struct map* m, int x, int y)
+{
+	return y * m->width + x;
+}
+
+static inline struct map_tile* map_tile(struct map* m, int x, int y)
+{
+	return &m->tiles[map_index(m, x, y)];
+}
+
+static inline bool map_bit(const struct map* m, const uint64_t* plane, int x, int y)
+{
+	return (plane[y * m->stride + (x >> 6)] >> (x & 63)) & 1;
+}
+
+static inline void map_set_bit(const struct map* m, uint64_t* plane, int x, int y)
+{
+	plane[y * m->stride + (x >> 6)] |= (uint64_t)1 << (x & 63);
+}
+
+// mask of the columns ax..bx (inclusive) within word w of a row
+static inline uint64_t map_span_mask(int w, int ax, int bx)
+{
+	uint64_t mask = ~(uint64_t)0;
+	if (w == ax >> 6) mask &= ~(uint64_t)0 << (ax & 63);
+	if (w == bx >> 6) mask &= ~(uint64_t)0 >> (63 - (bx & 63));
+	return mask;
+}
+
+// true if any bit in the rectangle ax/ay-bx/by (inclusive) is set
+bool map_rect_any(const struct map* m, const uint64_t* plane, int ax, int ay, int bx, int by)
+{
+	for (int y = ay; y <= by; y++) {
+		const uint64_t* row = plane + (size_t)y * m->stride;
+		for (int w = ax >> 6; w <= bx >> 6; w++)
+			if (row[w] & map_span_mask(w, ax, bx))
+				return true;
+	}
+	return false;
+}
+
+void map_rect_set(const struct map* m, uint64_t* plane, int ax, int ay, int bx, int by)
+{
+	for (int y = ay; y <= by; y++) {
+		uint64_t* row = plane + (size_t)y * m->stride;
+		for (int w = ax >> 6; w <= bx >> 6; w++)
+			row[w] |= map_span_mask(w, ax, bx);
+	}
+}
+
+void dump_map(struct map* m)
 {
-	char s[COLS + 1];
+	char* s = malloc(m->width + 1);
 	SDL_Log("");
-	for (int y = 0; y < ROWS; y++) {
-		for (int x = 0; x < COLS; x++) {
-			switch (map[y][x].type) {
+	for (int y = 0; y < m->height; y++) {
+		for (int x = 0; x < m->width; x++) {
+			switch (map_tile(m, x, y)->type) {
 				case TILE_TYPE_WALL: s[x] = 'x'; break;
 				case TILE_TYPE_FLOOR: s[x] = '.'; break;
 				case TILE_TYPE_SHROUD: s[x] = '~'; break;
@@ -190,9 +573,10 @@ void dump_map()
 
 			}
 		}
-		s[COLS] = '\0';
+		s[m->width] = '\0';
 		SDL_Log(s);
 	}
+	free(s);
 }
 
 const struct color WALL_TOP_COLOR = { 192, 192, 168 };
@@ -218,11 +602,30 @@ _Noreturn void fatal(SDL_PRINTF_FORMAT_STRING const char* format, ...)
 	va_start(argList, format);
 	char buffer[1024];
 	SDL_vsnprintf(buffer, sizeof(buffer), format, argList);
+#ifdef ROQUEST_HEADLESS
+	SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Fatal Error: %s", buffer);
+#else
 	SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Fatal Error", buffer, 0);
+#endif
 	SDL_Quit();
 	exit(1);
 }
 
+// processor time (user + kernel) consumed by the process in milliseconds
+double cpu_time_ms()
+{
+#ifdef _WIN32
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time))
+		return 0.0;
+	ULARGE_INTEGER k = { .LowPart = kernel_time.dwLowDateTime, .HighPart = kernel_time.dwHighDateTime };
+	ULARGE_INTEGER u = { .LowPart = user_time.dwLowDateTime, .HighPart = user_time.dwHighDateTime };
+	return (double)(k.QuadPart + u.QuadPart) / 10000.0;
+#else
+	return (double)clock() * 1000.0 / CLOCKS_PER_SEC;
+#endif
+}
+
 void* load_file(const char* path, uint32_t* size)
 {
 	SDL_assert(path && path[0]);
@@ -280,20 +683,68 @@ SDL_Texture* load_image(const char* file, int* w, int* h)
 	return texture;
 }
 
+struct map* map_create(int width, int height)
+{
+	SDL_assert(width > 0 && height > 0);
+
+	size_t area = (size_t)width * height;
+	struct map* m = malloc(sizeof(struct map));
+	if (!m) fatal("out of memory for map");
+	*m = (struct map){ .width = width, .height = height, .stride = (width + 63) / 64 };
+	size_t words = (size_t)m->stride * height;
+	m->tiles = calloc(area, sizeof(struct map_tile));
+	m->visible = calloc(words, sizeof(uint64_t));
+	m->explored = calloc(words, sizeof(uint64_t));
+	m->walkable = calloc(words, sizeof(uint64_t));
+	m->transparent = calloc(words, sizeof(uint64_t));
+	m->alive_at = malloc(area * sizeof(int16_t));
+	m->corpse_at = malloc(area * sizeof(int16_t));
+	if (!m->tiles || !m->visible || !m->explored || !m->walkable || !m->transparent || !m->alive_at || !m->corpse_at)
+		fatal("out of memory for map %dx%d", width, height);
+
+	return m;
+}
+
+void map_destroy(struct map* m)
+{
+	if (!m)
+		return;
+	free(m->tiles);
+	free(m->visible);
+	free(m->explored);
+	free(m->walkable);
+	free(m->transparent);
+	free(m->alive_at);
+	free(m->corpse_at);
+	free(m);
+}
+
+size_t map_memory(const struct map* m)
+{
+	size_t area = (size_t)m->width * m->height;
+	size_t words = (size_t)m->stride * m->height;
+	return sizeof(struct map) + area * (sizeof(struct map_tile) + 2 * sizeof(int16_t)) + words * 4 * sizeof(uint64_t);
+}
+
 // in bounds
-bool map_valid(int x, int y)
+bool map_valid(const struct map* m, int x, int y)
+{
+	return x >= 0 && x < m->width && y >= 0 && y < m->height;
+}
+
+bool map_walkable(struct map* m, int x, int y)
 {
-	return x >= 0 && x < COLS&& y >= 0 && y < ROWS;
+	return map_valid(m, x, y) && map_bit(m, m->walkable, x, y);
 }
 
-bool map_walkable(int x, int y)
+bool map_visible(struct map* m, int x, int y)
 {
-	return map_valid(x, y) && tiles[map[y][x].type].walkable;
+	return map_valid(m, x, y) && map_bit(m, m->visible, x, y);
 }
 
-bool map_visible(int x, int y)
+bool map_transparent(struct map* m, int x, int y)
 {
-	return map_valid(x, y) && map[y][x].visible;
+	return map_valid(m, x, y) && map_bit(m, m->transparent, x, y);
 }
 
 void get_actor_name(struct actor* a, char* res, int max)
@@ -306,25 +757,220 @@ void get_actor_name(struct actor* a, char* res, int max)
 	}
 }
 
-void add_message(struct color color, bool check_stack, const char* fmt, ...)
+// finished messages are appended to a journal on disk, so the history is
+// not limited by the log ring; the index file holds the 32 bit offset of
+// every record in the data file
+static struct {
+	SDL_RWops* data;
+	SDL_RWops* index;
+	char path[256];
+	uint32_t count; // records written
+	uint32_t size;  // bytes in the data file
+} journal;
+
+// template id, color, stack count and as many arguments as the template takes
+#define JOURNAL_RECORD_MAX (8 + 4 * MAX_MESSAGE_ARGS)
+
+static inline void put_le32(uint8_t* p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline uint32_t get_le32(const uint8_t* p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void journal_close()
+{
+	if (journal.data) SDL_RWclose(journal.data);
+	if (journal.index) SDL_RWclose(journal.index);
+	journal.data = journal.index = NULL;
+}
+
+// creates an empty journal, without one the history is only the log ring
+void journal_open(const char* path)
+{
+	char data_path[sizeof(journal.path)], index_path[sizeof(journal.path) + 4];
+	SDL_snprintf(data_path, sizeof(data_path), "%s", path);
+	SDL_snprintf(index_path, sizeof(index_path), "%s.idx", data_path);
+	journal_close();
+	strcpy(journal.path, data_path);
+	journal.count = journal.size = 0;
+	journal.data = SDL_RWFromFile(data_path, "w+b");
+	journal.index = SDL_RWFromFile(index_path, "w+b");
+	if (!journal.data || !journal.index) {
+		SDL_Log("could not write message journal '%s': %s", data_path, SDL_GetError());
+		journal_close();
+	}
+}
+
+void journal_append(const struct message* msg)
+{
+	if (!journal.data)
+		return;
+
+	const struct message_template* t = &message_templates[msg->id];
+	uint8_t record[JOURNAL_RECORD_MAX], offset[4];
+	int len = 0;
+	record[len++] = msg->id;
+	record[len++] = msg->fg.red;
+	record[len++] = msg->fg.green;
+	record[len++] = msg->fg.blue;
+	put_le32(record + len, msg->count);
+	len += 4;
+	for (int n = 0; n < MAX_MESSAGE_ARGS && t->args[n] != MESSAGE_ARG_NONE; n++, len += 4)
+		put_le32(record + len, msg->args[n]);
+	put_le32(offset, journal.size);
+
+	// reads move the file positions, so every write seeks to the end first
+	if (SDL_RWseek(journal.data, journal.size, RW_SEEK_SET) < 0 ||
+		SDL_RWwrite(journal.data, record, len, 1) != 1 ||
+		SDL_RWseek(journal.index, (Sint64)journal.count * 4, RW_SEEK_SET) < 0 ||
+		SDL_RWwrite(journal.index, offset, 4, 1) != 1) {
+		SDL_Log("could not append to message journal '%s': %s", journal.path, SDL_GetError());
+		journal_close();
+		return;
+	}
+	journal.size += len;
+	journal.count++;
+}
+
+// reads record n, the serial is left to the caller
+bool journal_read(uint32_t n, struct message* msg)
+{
+	if (!journal.data || n >= journal.count)
+		return false;
+
+	uint8_t record[JOURNAL_RECORD_MAX], offset[4];
+	if (SDL_RWseek(journal.index, (Sint64)n * 4, RW_SEEK_SET) < 0 ||
+		SDL_RWread(journal.index, offset, 4, 1) != 1 ||
+		SDL_RWseek(journal.data, get_le32(offset), RW_SEEK_SET) < 0)
+		return false;
+
+	// the last record may be shorter than the buffer
+	size_t len = SDL_RWread(journal.data, record, 1, sizeof(record));
+	if (len < 8 || record[0] >= NUM_MESSAGE_IDS)
+		return false;
+
+	const struct message_template* t = &message_templates[record[0]];
+	*msg = (struct message){ .id = record[0], .fg = { record[1], record[2], record[3] }, .count = get_le32(record + 4) };
+	for (int a = 0; a < MAX_MESSAGE_ARGS && t->args[a] != MESSAGE_ARG_NONE; a++) {
+		if (8 + 4 * a + 4 > len)
+			return false;
+		msg->args[a] = get_le32(record + 8 + 4 * a);
+	}
+	return true;
+}
+
+// appends the last message, it is only written when the next one arrives
+void journal_stop()
+{
+	if (journal.data && num_messages > 0)
+		journal_append(&messages[last_message]);
+	if (journal.data)
+		SDL_Log("message journal: %u messages, %u bytes", journal.count, journal.size);
+	journal_close();
+}
+
+// a new game starts an empty log and journal
+void clear_messages()
+{
+	num_messages = 0;
+	message_serial = 0;
+	memset(wrap_cache, 0, sizeof(wrap_cache));
+	if (journal.data)
+		journal_open(journal.path);
+}
+
+// number of messages in the history, the journal has all but the last one
+int history_size()
+{
+	return journal.data ? (int)journal.count + (num_messages > 0) : num_messages;
+}
+
+// the message back steps before the last one, from the log ring while it
+// still holds it, else read from the journal
+const struct message* history_message(int back)
+{
+	static struct message read;
+	if (back < num_messages) {
+		int cur = last_message - back;
+		if (cur < 0) cur += SDL_arraysize(messages);
+		return &messages[cur];
+	}
+	uint32_t serial = message_serial - back;
+	if (serial == 0 || !journal_read(serial - 1, &read))
+		return NULL;
+	read.serial = serial;
+	return &read;
+}
+
+// the arguments are ints, as many as the template takes
+void add_message(struct color color, bool check_stack, enum message_id id, ...)
 {
-	char buffer[MAX_MESSAGE_LEN];
+	struct message msg = { .id = id, .fg = color, .count = 1 };
+	const struct message_template* t = &message_templates[id];
 	va_list args;
-	va_start(args, fmt);
-	vsnprintf(buffer, sizeof(buffer), fmt, args);
+	va_start(args, id);
+	for (int n = 0; n < MAX_MESSAGE_ARGS && t->args[n] != MESSAGE_ARG_NONE; n++)
+		msg.args[n] = va_arg(args, int);
 	va_end(args);
 
-	if (check_stack && num_messages > 0 && !strcmp(messages[last_message].text, buffer)) {
-		messages[last_message].count++;
+	msg.hash = 2166136261u ^ id;
+	for (int n = 0; n < MAX_MESSAGE_ARGS; n++)
+		msg.hash = (msg.hash ^ (uint32_t)msg.args[n]) * 16777619u;
+
+	// same template and arguments give the same text
+	struct message* last = &messages[last_message];
+	if (check_stack && num_messages > 0 && last->hash == msg.hash && last->id == msg.id &&
+		!memcmp(last->args, msg.args, sizeof(msg.args))) {
+		last->count++;
 	}
 	else {
+		if (num_messages > 0)
+			journal_append(last);
 		if (num_messages < SDL_arraysize(messages))
 			num_messages++;
 		last_message = (last_message + 1) % SDL_arraysize(messages);
-		strcpy(messages[last_message].text, buffer);
-		messages[last_message].count = 1;
-		messages[last_message].fg = color;
+		msg.serial = ++message_serial;
+		messages[last_message] = msg;
+	}
+}
+
+// formats the text of a message with its stack count
+void format_message(const struct message* msg, char* res, int max)
+{
+	SDL_assert(max > 0);
+	const struct message_template* t = &message_templates[msg->id];
+	int len = 0, arg = 0;
+	for (const char* p = t->format; *p && len < max - 1; p++) {
+		if (*p != '%' || !p[1]) {
+			res[len++] = *p;
+			continue;
+		}
+
+		// the conversion letter is only for reading, the template decides
+		p++;
+		SDL_assert(arg < MAX_MESSAGE_ARGS);
+		int value = msg->args[arg];
+		switch (t->args[arg++]) {
+			case MESSAGE_ARG_NAME:
+			case MESSAGE_ARG_NAME_UPPER:
+				for (const char* name = actor_catalog[value].name; *name && len < max - 1; name++)
+					res[len++] = t->args[arg - 1] == MESSAGE_ARG_NAME_UPPER ? toupper(*name) : *name;
+				break;
+			case MESSAGE_ARG_INT:
+				len += SDL_snprintf(res + len, max - len, "%d", value);
+				len = mini(len, max - 1);
+				break;
+		}
+	}
+	if (msg->count > 1 && len < max - 1) {
+		len += SDL_snprintf(res + len, max - len, "  (x%d)", msg->count);
+		len = mini(len, max - 1);
 	}
+	res[len] = '\0';
 }
 
 static uint8_t g_alpha = 255;
@@ -334,50 +980,173 @@ void set_render_alpha(uint8_t alpha)
 	SDL_SetTextureAlphaMod(g.font, g_alpha = alpha);
 }
 
-#define MAX_SPRITES 0x4000
-static struct SDL_Vertex g_verts[MAX_SPRITES * 4];
-static uint16_t g_inds[MAX_SPRITES * 6];
-static uint32_t g_num_sprites;
+// quads with 16 bit indices, so at most 0x4000 quads per batch
+struct quad_batch {
+	SDL_Vertex* verts;
+	uint16_t* inds;
+	uint32_t capacity;
+	uint32_t count;
+};
 
-void render_tile(int x, int y, int ch, struct color color)
+#define MAX_BATCH_QUADS 0x4000
+
+// the map is retained in its own batch: one glyph quad per cell of the
+// view, a cell is only encoded again when its key (tile type, visibility,
+// occupant) changed
+#define MAP_QUADS (ROWS * COLS)
+#define OCCUPANT_CORPSE 0x80
+
+// everything else is drawn through a chunk that is flushed whenever it is
+// full, it holds a glyph for every cell of the window
+#define SPRITE_QUADS (SCREEN_ROWS * SCREEN_COLS)
+
+static struct quad_batch g_map_batch;
+static struct quad_batch g_sprites;
+static uint32_t g_num_sprites; // sprite quads drawn this frame
+static uint32_t g_num_flushes; // sprite chunks submitted this frame
+static Uint64 g_submit_ticks;  // ticks spent in submission this frame
+
+// cell background colours: one RGBA texel per cell in a streaming texture
+// that is stretched over the cells with nearest scaling, only the glyphs
+// go through the quad batches
+struct bg_layer {
+	SDL_Texture* texture;
+	SDL_Color* texels;
+	int width, height;
+	bool dirty;   // texels differ from the texture
+	bool pending; // texels not drawn yet (window layer)
+};
+
+static struct bg_layer g_map_bg; // view cells, drawn into the map layer
+static struct bg_layer g_ui_bg;  // window cells, drawn below the sprites
+
+// window cells with a sprite queued since the last flush
+static uint64_t g_sprite_cells[SCREEN_ROWS][(SCREEN_COLS + 63) / 64];
+
+static uint32_t g_cell_keys[ROWS][COLS];
+static uint32_t g_cells_encoded;
+
+void init_quad_batch(struct quad_batch* b, uint32_t capacity)
 {
-	ch &= 0xff;
+	SDL_assert(capacity <= MAX_BATCH_QUADS);
+	b->verts = malloc(capacity * 4 * sizeof(SDL_Vertex));
+	b->inds = malloc(capacity * 6 * sizeof(uint16_t));
+	if (!b->verts || !b->inds) fatal("out of memory for %u quads", capacity);
+	b->capacity = capacity;
+	b->count = 0;
+
+	// quad n always uses vertices 4n..4n+3, so the indices never change
+	for (uint32_t n = 0; n < capacity; n++) {
+		uint16_t idx = n * 4;
+		uint16_t* pi = &b->inds[n * 6];
+		*pi++ = idx; *pi++ = idx + 1; *pi++ = idx + 2;
+		*pi++ = idx; *pi++ = idx + 2; *pi = idx + 3;
+	}
+}
 
-	float inv = 1.0f / 16.0f;
+// glyph rectangles in the font atlas (16 x 16 glyphs) and the edges of the
+// window cells, filled by init_quad_tables when the font is loaded
+struct glyph_uv {
+	float u0, v0, u1, v1;
+};
 
-	float sx0 = (float)(ch % 16) * inv;
-	float sx1 = sx0 + inv;
-	float sy0 = (float)(ch / 16) * inv;
-	float sy1 = sy0 + inv;
+static struct glyph_uv g_glyph_uvs[256];
+static float g_cell_x[SCREEN_COLS + 1];
+static float g_cell_y[SCREEN_ROWS + 1];
 
-	float mulx = (float)(TILE_WIDTH * ZOOMX);
-	float muly = (float)(TILE_HEIGHT * ZOOMY);
+void init_quad_tables(int font_width, int font_height)
+{
+	for (int ch = 0; ch < 256; ch++) {
+		int gx = (ch % 16) * (font_width / 16);
+		int gy = (ch / 16) * (font_height / 16);
+		g_glyph_uvs[ch] = (struct glyph_uv){
+			.u0 = (float)gx / font_width, .v0 = (float)gy / font_height,
+			.u1 = (float)(gx + font_width / 16) / font_width, .v1 = (float)(gy + font_height / 16) / font_height
+		};
+	}
 
-	float dx0 = x * mulx;
-	float dx1 = dx0 + mulx;
-	float dy0 = y * muly;
-	float dy1 = dy0 + muly;
+	for (int x = 0; x <= SCREEN_COLS; x++)
+		g_cell_x[x] = (float)(x * TILE_WIDTH * ZOOMX);
+	for (int y = 0; y <= SCREEN_ROWS; y++)
+		g_cell_y[y] = (float)(y * TILE_HEIGHT * ZOOMY);
+}
+
+void init_bg_layer(struct bg_layer* l, int width, int height)
+{
+	l->texture = SDL_CreateTexture(g.renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, width, height);
+	if (!l->texture) fatal("could not create background texture: %s", SDL_GetError());
+	SDL_SetTextureBlendMode(l->texture, SDL_BLENDMODE_BLEND);
+	SDL_SetTextureScaleMode(l->texture, SDL_ScaleModeNearest);
+	l->texels = calloc((size_t)width * height, sizeof(SDL_Color));
+	if (!l->texels) fatal("out of memory for background layer");
+	l->width = width;
+	l->height = height;
+	l->dirty = true;
+}
+
+// uploads the texels if they changed and stretches them over the cells
+void draw_bg_layer(struct bg_layer* l)
+{
+	Uint64 start = SDL_GetPerformanceCounter();
+	if (l->dirty) {
+		SDL_UpdateTexture(l->texture, NULL, l->texels, l->width * sizeof(SDL_Color));
+		l->dirty = false;
+	}
+	SDL_Rect dst = { 0, 0, l->width * TILE_WIDTH * ZOOMX, l->height * TILE_HEIGHT * ZOOMY };
+	SDL_RenderCopy(g.renderer, l->texture, NULL, &dst);
+	g_submit_ticks += SDL_GetPerformanceCounter() - start;
+}
 
-	SDL_Color col = { .r = color.red, .g = color.green, .b = color.blue, .a = g_alpha };
+// the pending backgrounds are drawn in one go below the pending sprites. a
+// cell that already has a pending background or sprite flushes first, so
+// the background still lands on top of what was drawn there before
+void set_background(int x, int y, SDL_Color color)
+{
+	if ((unsigned)x >= (unsigned)g_ui_bg.width || (unsigned)y >= (unsigned)g_ui_bg.height)
+		return;
+	SDL_Color* texel = &g_ui_bg.texels[y * g_ui_bg.width + x];
+	if (texel->a || (g_sprite_cells[y][x >> 6] >> (x & 63) & 1))
+		flush_sprites();
+	*texel = color;
+	g_ui_bg.dirty = g_ui_bg.pending = true;
+}
 
-	if (g_num_sprites == MAX_SPRITES) fatal("too many quads");
+void submit_quads(struct quad_batch* b, SDL_Texture* texture, uint32_t count)
+{
+	if (count == 0)
+		return;
 
-	uint16_t idx = g_num_sprites * 4;
+	Uint64 start = SDL_GetPerformanceCounter();
+	SDL_RenderGeometryRaw(g.renderer, texture, &b->verts[0].position.x, sizeof(b->verts[0]),
+		&b->verts[0].color, sizeof(b->verts[0]), &b->verts[0].tex_coord.x, sizeof(b->verts[0]),
+		count * 4, b->inds, count * 6, sizeof(b->inds[0]));
+	g_submit_ticks += SDL_GetPerformanceCounter() - start;
+}
 
-	uint16_t* pi = &g_inds[g_num_sprites * 6];
-	*pi++ = idx; *pi++ = idx + 1; *pi++ = idx + 2;
-	*pi++ = idx; *pi++ = idx + 2; *pi = idx + 3;
+// draws the pending backgrounds and then the pending sprite quads, the
+// colors already carry g_alpha
+void flush_sprites()
+{
+	if (g_ui_bg.pending) {
+		draw_bg_layer(&g_ui_bg);
+		memset(g_ui_bg.texels, 0, (size_t)g_ui_bg.width * g_ui_bg.height * sizeof(SDL_Color));
+		g_ui_bg.dirty = true;
+		g_ui_bg.pending = false;
+	}
 
-	SDL_Vertex* pv = &g_verts[idx];
+	if (g_sprites.count == 0)
+		return;
 
-	pv[0] = (SDL_Vertex){ .position.x = dx0, .position.y = dy0, .color = col, .tex_coord.x = sx0, .tex_coord.y = sy0 };
-	pv[1] = (SDL_Vertex){ .position.x = dx1, .position.y = dy0, .color = col, .tex_coord.x = sx1, .tex_coord.y = sy0 };
-	pv[2] = (SDL_Vertex){ .position.x = dx1, .position.y = dy1, .color = col, .tex_coord.x = sx1, .tex_coord.y = sy1 };
-	pv[3] = (SDL_Vertex){ .position.x = dx0, .position.y = dy1, .color = col, .tex_coord.x = sx0, .tex_coord.y = sy1 };
-	g_num_sprites += 1;
+	memset(g_sprite_cells, 0, sizeof(g_sprite_cells));
+	SDL_SetTextureAlphaMod(g.font, 255);
+	submit_quads(&g_sprites, g.font, g_sprites.count);
+	SDL_SetTextureAlphaMod(g.font, g_alpha);
+	g_sprites.count = 0;
+	g_num_flushes++;
 }
 
-void render_tile2(int x, int y, int ch, SDL_Color color)
+// reference encoder without tables, only used by bench_quads
+void encode_quad_computed(struct quad_batch* b, uint32_t slot, int x, int y, int ch, SDL_Color color)
 {
 	ch &= 0xff;
 
@@ -396,26 +1165,67 @@ void render_tile2(int x, int y, int ch, SDL_Color color)
 	float dy0 = y * muly;
 	float dy1 = dy0 + muly;
 
-	if (g_num_sprites == MAX_SPRITES) fatal("too many quads");
+	SDL_assert(slot < b->capacity);
+	uint16_t idx = slot * 4;
 
-	uint16_t idx = g_num_sprites * 4;
-
-	uint16_t* pi = &g_inds[g_num_sprites * 6];
+	uint16_t* pi = &b->inds[slot * 6];
 	*pi++ = idx; *pi++ = idx + 1; *pi++ = idx + 2;
 	*pi++ = idx; *pi++ = idx + 2; *pi = idx + 3;
 
-	SDL_Vertex* pv = &g_verts[idx];
+	SDL_Vertex* pv = &b->verts[idx];
 
 	pv[0] = (SDL_Vertex){ .position.x = dx0, .position.y = dy0, .color = color, .tex_coord.x = sx0, .tex_coord.y = sy0 };
 	pv[1] = (SDL_Vertex){ .position.x = dx1, .position.y = dy0, .color = color, .tex_coord.x = sx1, .tex_coord.y = sy0 };
 	pv[2] = (SDL_Vertex){ .position.x = dx1, .position.y = dy1, .color = color, .tex_coord.x = sx1, .tex_coord.y = sy1 };
 	pv[3] = (SDL_Vertex){ .position.x = dx0, .position.y = dy1, .color = color, .tex_coord.x = sx0, .tex_coord.y = sy1 };
-	g_num_sprites += 1;
+}
+
+void encode_quad(struct quad_batch* b, uint32_t slot, int x, int y, int ch, SDL_Color color)
+{
+	SDL_assert(slot < b->capacity);
+	const struct glyph_uv* uv = &g_glyph_uvs[ch & 0xff];
+
+	// cells outside of the window (text running off the edge) are computed
+	float dx0, dx1, dy0, dy1;
+	if ((unsigned)x < SCREEN_COLS && (unsigned)y < SCREEN_ROWS) {
+		dx0 = g_cell_x[x];
+		dx1 = g_cell_x[x + 1];
+		dy0 = g_cell_y[y];
+		dy1 = g_cell_y[y + 1];
+	}
+	else {
+		dx0 = (float)(x * TILE_WIDTH * ZOOMX);
+		dx1 = dx0 + TILE_WIDTH * ZOOMX;
+		dy0 = (float)(y * TILE_HEIGHT * ZOOMY);
+		dy1 = dy0 + TILE_HEIGHT * ZOOMY;
+	}
+
+	SDL_Vertex* pv = &b->verts[slot * 4];
+	pv[0] = (SDL_Vertex){ .position.x = dx0, .position.y = dy0, .color = color, .tex_coord.x = uv->u0, .tex_coord.y = uv->v0 };
+	pv[1] = (SDL_Vertex){ .position.x = dx1, .position.y = dy0, .color = color, .tex_coord.x = uv->u1, .tex_coord.y = uv->v0 };
+	pv[2] = (SDL_Vertex){ .position.x = dx1, .position.y = dy1, .color = color, .tex_coord.x = uv->u1, .tex_coord.y = uv->v1 };
+	pv[3] = (SDL_Vertex){ .position.x = dx0, .position.y = dy1, .color = color, .tex_coord.x = uv->u0, .tex_coord.y = uv->v1 };
+}
+
+void render_tile2(int x, int y, int ch, SDL_Color color)
+{
+	if (g_sprites.count == g_sprites.capacity)
+		flush_sprites();
+
+	encode_quad(&g_sprites, g_sprites.count++, x, y, ch, color);
+	g_num_sprites++;
+	if ((unsigned)x < SCREEN_COLS && (unsigned)y < SCREEN_ROWS)
+		g_sprite_cells[y][x >> 6] |= (uint64_t)1 << (x & 63);
+}
+
+void render_tile(int x, int y, int ch, struct color color)
+{
+	render_tile2(x, y, ch, (SDL_Color) { .r = color.red, .g = color.green, .b = color.blue, .a = g_alpha });
 }
 
 void render_tile_with_bg(int x, int y, int ch, struct color fg, struct color bg)
 {
-	render_tile(x, y, 0xdb, bg);
+	set_background(x, y, (SDL_Color) { .r = bg.red, .g = bg.green, .b = bg.blue, .a = g_alpha });
 	render_tile(x, y, ch, fg);
 }
 
@@ -439,7 +1249,7 @@ void write(int x, int y, int len, struct dbuf_char* dbuf)
 {
 	for (; len-- > 0; x++, dbuf++) {
 		if (dbuf->bg.a > 0)
-			render_tile2(x, y, 0xdb, dbuf->bg);
+			set_background(x, y, dbuf->bg);
 		if (dbuf->fg.a > 0)
 			render_tile2(x, y, dbuf->ch, dbuf->fg);
 	}
@@ -448,7 +1258,7 @@ void write(int x, int y, int len, struct dbuf_char* dbuf)
 void write_char(int x, int y, char ch, SDL_Color fg, SDL_Color bg)
 {
 	if (bg.a > 0)
-		render_tile2(x, y, 0xdb, bg);
+		set_background(x, y, bg);
 	if (fg.a > 0)
 		render_tile2(x, y, ch, fg);
 }
@@ -537,8 +1347,10 @@ void draw_frame(int x, int y, int w, int h, SDL_Color fg, SDL_Color bg, const ch
 void draw_gauge(int x, int y, int len, float rate, struct color fill, struct color empty)
 {
 	int fw = (int)(len * rate);
-	for (int n = 0; n < len; n++)
-		render_tile(x + n, y, 0xdb, n < fw ? fill : empty);
+	for (int n = 0; n < len; n++) {
+		struct color c = n < fw ? fill : empty;
+		set_background(x + n, y, (SDL_Color) { .r = c.red, .g = c.green, .b = c.blue, .a = g_alpha });
+	}
 }
 
 void draw_text(int x, int y, struct color color, const char* fmt, ...)
@@ -581,64 +1393,76 @@ const char* wrap_text(char* res, int max_len, const char* text)
 	}
 
 	if (res) {
-		memcpy(res, text, c);
-		if (res[c - 1] == '\n') {
-			c--;
-		}
-		res[c] = '\0';
+		// the newline is not copied, but still consumed
+		intptr_t len = text[c - 1] == '\n' ? c - 1 : c;
+		memcpy(res, text, len);
+		res[len] = '\0';
 	}
 
 	return text + c;
 }
 
-int calc_lines(const char* text, int max_width)
+// returns the line breaks of a message formatted into text, wraps it on a
+// miss or if the stack count changed since
+struct wrap_entry* wrap_message(const struct message* msg, int width, const char* text)
 {
-	int lines = 0;
-	while (*text) {
-		text = wrap_text(NULL, max_width, text);
-		lines++;
+	struct wrap_entry* e = &wrap_cache[(msg->serial ^ width * 0x9e3779b9u) & (WRAP_CACHE_SIZE - 1)];
+	if (e->serial == msg->serial && e->width == width && e->count == msg->count)
+		return e;
+
+	const char* p = text;
+	e->num_lines = 0;
+	while (*p && e->num_lines < MAX_WRAP_LINES) {
+		e->line_start[e->num_lines++] = (uint16_t)(p - text);
+		p = wrap_text(NULL, width, p);
 	}
-	return lines;
+	e->line_start[e->num_lines] = (uint16_t)(p - text);
+	e->serial = msg->serial;
+	e->width = width;
+	e->count = msg->count;
+	return e;
+}
+
+void draw_span(int x, int y, struct color color, const char* p, int len)
+{
+	// lines keep their break, but not a trailing newline
+	if (len > 0 && p[len - 1] == '\n')
+		len--;
+	for (int n = 0; n < len; n++)
+		render_tile(x + n, y, p[n], color);
 }
 
+// draws the history from start messages before the last one upwards, only
+// the messages on screen are read
 void render_message_log(int x, int y, int width, int height, int start)
 {
-	if (num_messages == 0)
+	int size = history_size();
+	if (size == 0)
 		return;
 
-	start = mini(num_messages - 1, maxi(start, 0));
+	start = mini(size - 1, maxi(start, 0));
 
 	int yofs = y + height;
-	int cur = last_message - start;
-	if (cur < 0) cur += SDL_arraysize(messages);
-	int num = num_messages - start;
-	char line[COLS];
 	int vspace = height;
-	char text[MAX_MESSAGE_LEN];
-	while (vspace > 0 && num-- > 0) {
+	for (int back = start; vspace > 0 && back < size; back++) {
 
-		const char* p = messages[cur].text;
-		if (messages[cur].count > 1) {
-			snprintf(text, sizeof(text), "%s  (x%d)", p, messages[cur].count);
-			p = text;
-		}
+		const struct message* msg = history_message(back);
+		if (!msg)
+			break;
+		char text[MAX_FORMATTED_LEN];
+		format_message(msg, text, sizeof(text));
+		struct wrap_entry* e = wrap_message(msg, width, text);
 
-		int lines = calc_lines(p, width);
-		while (lines > vspace) {
-			p = wrap_text(NULL, width, p);
-			lines--;
-		}
+		// the top lines are cut when the message does not fit
+		int first = maxi(e->num_lines - vspace, 0);
+		int lines = e->num_lines - first;
 
 		yofs -= lines;
 		vspace -= lines;
-		int n = 0;
-		while (*p) {
-			p = wrap_text(line, width, p);
-			draw_text(x, yofs + n++, messages[cur].fg, line);
+		for (int n = 0; n < lines; n++) {
+			int a = e->line_start[first + n], b = e->line_start[first + n + 1];
+			draw_span(x, yofs + n, msg->fg, text + a, b - a);
 		}
-
-		cur = cur - 1;
-		if (cur < 0) cur += num_messages;
 	}
 }
 
@@ -651,55 +1475,129 @@ void render_hp_bar()
 	draw_text(1, 45, bar_text, "HP: %d/%d", hp, max_hp);
 }
 
-void render_map_set()
+void invalidate_map_cells()
 {
-	// center map in window
-	// int sx = (WINDOW_WIDTH / (TILE_WIDTH * ZOOMX) - COLS) / 2;
-	// int sy = (WINDOW_HEIGHT / (TILE_HEIGHT * ZOOMY) - ROWS) / 2;
-	int sx = 0;
-	int sy = 0;
+	memset(g_cell_keys, 0xff, sizeof(g_cell_keys));
+}
+
+// centers the camera on the player, clamped to the level, returns true if
+// it moved
+bool update_camera(struct map* m)
+{
+	int cx = maxi(mini(actors[0].x - COLS / 2, m->width - COLS), 0);
+	int cy = maxi(mini(actors[0].y - ROWS / 2, m->height - ROWS), 0);
+	if (cx == g.camera_x && cy == g.camera_y)
+		return false;
+	g.camera_x = cx;
+	g.camera_y = cy;
+	return true;
+}
+
+// map tile under the mouse, false if the mouse is not over the map view
+bool mouse_map_pos(struct map* m, int* x, int* y)
+{
+	if (g.mouse_x < 0 || g.mouse_y < 0 || g.mouse_x >= COLS || g.mouse_y >= ROWS)
+		return false;
+	*x = g.mouse_x + g.camera_x;
+	*y = g.mouse_y + g.camera_y;
+	return map_valid(m, *x, *y);
+}
+
+// re-encodes the changed cells of the view and draws them into the map
+// layer, only the COLS x ROWS tiles under the camera are looked at
+void render_map_layer(struct map* m)
+{
+	// cells outside of the level are unexplored shroud
+	static const struct map_tile outside = { .type = TILE_TYPE_SHROUD };
 
 	// map
 	for (int y = 0; y < ROWS; y++) {
 		for (int x = 0; x < COLS; x++) {
+			int mx = g.camera_x + x, my = g.camera_y + y;
+			bool inside = map_valid(m, mx, my);
+			const struct map_tile* t = inside ? map_tile(m, mx, my) : &outside;
+			int i = inside ? map_index(m, mx, my) : 0;
+			bool visible = inside && map_bit(m, m->visible, mx, my);
+			bool explored = inside && map_bit(m, m->explored, mx, my);
+			// occupant: living actors are drawn above corpses
+			uint8_t occ = 0;
+			if (visible && m->alive_at[i] != NO_ACTOR)
+				occ = actors[m->alive_at[i]].type + 1;
+			else if (visible && m->corpse_at[i] != NO_ACTOR)
+				occ = OCCUPANT_CORPSE;
+			uint32_t key = t->type | (visible ? 0x100 : 0) | (explored ? 0x200 : 0) | (occ << 16);
+			if (g_cell_keys[y][x] == key)
+				continue;
+			g_cell_keys[y][x] = key;
+			g_cells_encoded++;
+
 			struct tile_graphic* tg;
-			if (!map[y][x].explored) {
+			if (!explored) {
 				tg = &tiles[0].light;
 			}
 			else {
-				struct tile_info* ti = &tiles[map[y][x].type];
-				tg = map[y][x].visible ? &ti->light : &ti->dark;
+				struct tile_info* ti = &tiles[t->type];
+				tg = visible ? &ti->light : &ti->dark;
 			}
-			write_char(sx + x, sy + y, tg->ch, (SDL_Color){tg->fg.red, tg->fg.green, tg->fg.blue, 255}, (SDL_Color){tg->bg.red, tg->bg.green, tg->bg.blue, 255});
-			// render_tile_with_bg(sx + x, sy + y, tg->ch, tg->fg, tg->bg);
+
+			uint32_t slot = y * COLS + x;
+			g_map_bg.texels[slot] = COL2SDL(tg->bg);
+			g_map_bg.dirty = true;
+			if (occ == OCCUPANT_CORPSE)
+				encode_quad(&g_map_batch, slot, x, y, '%', (SDL_Color) { 191, 0, 0, 255 });
+			else if (occ)
+				encode_quad(&g_map_batch, slot, x, y, actor_catalog[occ - 1].character, COL2SDL(actor_catalog[occ - 1].color));
+			else
+				encode_quad(&g_map_batch, slot, x, y, tg->ch, COL2SDL(tg->fg));
 		}
 	}
 
-	// entities: player + monsters
-	for (int i = 0; i < 2; i++) {
-		for (int k = 0; k < num_actors; k++) {
-			struct actor* a = &actors[k];
-			if ((i == 0) != a->alive) {
-				if (map[a->y][a->x].visible) {
-					struct actor_info* e = &actor_catalog[a->type];
-					if (!a->alive)
-						render_tile2(sx + a->x, sy + a->y, '%', (SDL_Color) { 191, 0, 0, 255 });
-					else
-						render_tile2(sx + a->x, sy + a->y, e->character, COL2SDL(e->color));
-				}
-			}
-		}
+	// pending sprites belong to the window, not to the map layer
+	flush_sprites();
+
+	SDL_SetRenderTarget(g.renderer, g.map_layer);
+	SDL_SetRenderDrawColor(g.renderer, 0, 0, 0, 255);
+	SDL_RenderClear(g.renderer);
+	draw_bg_layer(&g_map_bg);
+	SDL_SetTextureAlphaMod(g.font, 255);
+	submit_quads(&g_map_batch, g.font, MAP_QUADS);
+	SDL_SetTextureAlphaMod(g.font, g_alpha);
+	SDL_SetRenderTarget(g.renderer, NULL);
+}
+
+void render_map_set(struct map* m)
+{
+	// center map in window
+	// int sx = (WINDOW_WIDTH / (TILE_WIDTH * ZOOMX) - COLS) / 2;
+	// int sy = (WINDOW_HEIGHT / (TILE_HEIGHT * ZOOMY) - ROWS) / 2;
+	int sx = 0;
+	int sy = 0;
+
+	// the map layer is only redrawn after map, fov, actor or camera changes
+	g_cells_encoded = 0;
+	if (update_camera(m))
+		g.map_dirty = true;
+	if (g.map_dirty) {
+		render_map_layer(m);
+		g.map_dirty = false;
 	}
 
+	SDL_Rect dst = { sx * TILE_WIDTH * ZOOMX, sy * TILE_HEIGHT * ZOOMY, MAP_LAYER_WIDTH, MAP_LAYER_HEIGHT };
+	SDL_SetTextureAlphaMod(g.map_layer, g_alpha);
+	SDL_RenderCopy(g.renderer, g.map_layer, NULL, &dst);
+
 	render_message_log(21, 45, 40, 5, 0);
 
 	render_hp_bar();
 
-	if (map_visible(g.mouse_x, g.mouse_y)) {
+	int mx, my;
+	if (mouse_map_pos(m, &mx, &my) && map_visible(m, mx, my)) {
 		char buffer[256], name[48];
 		buffer[0] = '\0';
-		for (int i = 0; i < num_actors; i++) {
-			if (actors[i].x == g.mouse_x && actors[i].y == g.mouse_y) {
+		int i = map_index(m, mx, my);
+		int16_t* layers[2] = { &m->alive_at[i], &m->corpse_at[i] };
+		for (int k = 0; k < 2; k++) {
+			for (int i = *layers[k]; i != NO_ACTOR; i = actors[i].next) {
 				if (buffer[0])
 					strcat(buffer, ", ");
 				get_actor_name(&actors[i], name, sizeof(name));
@@ -714,155 +1612,725 @@ void render_map_set()
 	}
 }
 
-static uint32_t random_seed = 0x17041971;
+// p50/p95/p99 per phase in microseconds, in the top right corner
+void render_profiler()
+{
+	double us = 1000000.0 / SDL_GetPerformanceFrequency();
+	int x = SCREEN_COLS - 30;
+	draw_text(x, 1, white, "phase      p50    p95    p99");
+	for (int n = 0; n < NUM_PROFILE_PHASES; n++) {
+		Uint64 p[3];
+		if (profile_percentiles(n, p))
+			draw_text(x, 2 + n, white, "%-8s%6.0f %6.0f %6.0f", profile_phase_names[n], p[0] * us, p[1] * us, p[2] * us);
+		else
+			draw_text(x, 2 + n, white, "%-8s     -      -      -", profile_phase_names[n]);
+	}
+}
+
+// writes the sample history of all phases as csv (phase, sample, us)
+void dump_profile(const char* path)
+{
+	SDL_RWops* rw = SDL_RWFromFile(path, "w");
+	if (!rw) {
+		SDL_Log("could not write '%s': %s", path, SDL_GetError());
+		return;
+	}
+
+	double us = 1000000.0 / SDL_GetPerformanceFrequency();
+	char line[128];
+	int len = SDL_snprintf(line, sizeof(line), "phase,sample,us\n");
+	SDL_RWwrite(rw, line, 1, len);
+	for (int n = 0; n < NUM_PROFILE_PHASES; n++) {
+		struct profile_ring* r = &profile[n];
+		// oldest sample first
+		uint32_t first = r->count > PROFILE_HISTORY ? r->count - PROFILE_HISTORY : 0;
+		for (uint32_t i = first; i < r->count; i++) {
+			len = SDL_snprintf(line, sizeof(line), "%s,%u,%.2f\n", profile_phase_names[n], i, r->ticks[i % PROFILE_HISTORY] * us);
+			SDL_RWwrite(rw, line, 1, len);
+		}
+	}
+
+	SDL_RWclose(rw);
+	SDL_Log("profile written to '%s'", path);
+}
+
+// counter based random numbers: value n of a stream is a hash of the stream
+// key and n, so every subsystem and level draws from its own stream without
+// shared state and a stream can be filled in bulk
+enum rng_stream_id {
+	RNG_STREAM_LAYOUT,
+	RNG_STREAM_CARVE,
+	RNG_STREAM_MONSTERS,
+	RNG_STREAM_BENCH
+};
+
+struct rng {
+	uint64_t key;
+	uint64_t counter;
+};
+
+static uint64_t game_seed = 0x17041971;
+static uint32_t num_levels; // levels generated since the game seed was set
+
+void seed_game(uint64_t seed)
+{
+	game_seed = seed;
+	num_levels = 0;
+}
+
+// splitmix64 finalizer
+static inline uint64_t rng_mix(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+struct rng rng_stream(uint64_t seed, enum rng_stream_id id, uint32_t level)
+{
+	return (struct rng){ .key = rng_mix(seed ^ rng_mix((uint64_t)id << 32 | level)) };
+}
+
+// value n of the stream with the key
+static inline uint32_t rng_at(uint64_t key, uint64_t n)
+{
+	return (uint32_t)(rng_mix(key + n * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+static inline uint32_t rng_next(struct rng* r)
+{
+	return rng_at(r->key, r->counter++);
+}
+
+#ifdef HAVE_AVX2_PATHS
+// low 64 bits of the lane products, avx2 only multiplies 32 bit halves
+__attribute__((target("avx2")))
+static inline __m256i mul64_avx2(__m256i a, __m256i b)
+{
+	__m256i lo = _mm256_mul_epu32(a, b);
+	__m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b), _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+	return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+// rng_at for four counters at once, returns how many values were written
+__attribute__((target("avx2")))
+static int rng_fill_avx2(uint64_t key, uint64_t base, uint32_t* out, int count)
+{
+	const uint64_t golden = 0x9e3779b97f4a7c15ull;
+	const __m256i c1 = _mm256_set1_epi64x((long long)0xbf58476d1ce4e5b9ull);
+	const __m256i c2 = _mm256_set1_epi64x((long long)0x94d049bb133111ebull);
+	const __m256i step = _mm256_set1_epi64x((long long)(4 * golden));
+	const __m256i high = _mm256_setr_epi32(1, 3, 5, 7, 1, 3, 5, 7);
+	uint64_t z0 = key + base * golden;
+	__m256i z = _mm256_setr_epi64x((long long)z0, (long long)(z0 + golden), (long long)(z0 + 2 * golden), (long long)(z0 + 3 * golden));
+
+	int n = 0;
+	for (; n + 4 <= count; n += 4) {
+		__m256i v = _mm256_xor_si256(z, _mm256_srli_epi64(z, 30));
+		v = mul64_avx2(v, c1);
+		v = _mm256_xor_si256(v, _mm256_srli_epi64(v, 27));
+		v = mul64_avx2(v, c2);
+		v = _mm256_xor_si256(v, _mm256_srli_epi64(v, 31));
+		_mm_storeu_si128((__m128i*)(out + n), _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v, high)));
+		z = _mm256_add_epi64(z, step);
+	}
+	return n;
+}
+#endif
+
+// fills out with the next count values of the stream, four at a time with
+// avx2 if the cpu has it
+void rng_fill(struct rng* r, uint32_t* restrict out, int count)
+{
+	uint64_t key = r->key, base = r->counter;
+	int n = 0;
+#ifdef HAVE_AVX2_PATHS
+	if (SDL_HasAVX2())
+		n = rng_fill_avx2(key, base, out, count);
+#endif
+	for (; n < count; n++)
+		out[n] = rng_at(key, base + n);
+	r->counter += count;
+}
 
-static uint32_t next_rand()
+// maps a random value to 0..not_included_max-1
+static inline uint32_t rng_bound(uint32_t value, uint32_t not_included_max)
 {
-	return random_seed = random_seed * 134775813 + 1;
+	return (uint32_t)((uint64_t)not_included_max * value >> 32);
 }
 
-uint32_t random(uint32_t not_included_max)
+uint32_t random(struct rng* r, uint32_t not_included_max)
 {
-	uint64_t result = (uint64_t)not_included_max * (uint64_t)next_rand();
-	return result >> 32;
+	return rng_bound(rng_next(r), not_included_max);
 }
 
-int random_range(int included_min, int included_max)
+int random_range(struct rng* r, int included_min, int included_max)
 {
 	SDL_assert(included_min <= included_max);
-	return included_min + random(included_max - included_min + 1);
+	return included_min + random(r, included_max - included_min + 1);
 }
 
 struct room {
 	int ax, ay, bx, by;
 };
 
-void spawn_actor(enum actor_type type, int x, int y)
+void clear_occupancy(struct map* m)
+{
+	size_t area = (size_t)m->width * m->height;
+	memset(m->alive_at, 0xff, area * sizeof(int16_t));
+	memset(m->corpse_at, 0xff, area * sizeof(int16_t));
+}
+
+void occupancy_link(struct map* m, int16_t* layer, int index)
+{
+	struct actor* a = &actors[index];
+	int i = map_index(m, a->x, a->y);
+	a->next = layer[i];
+	layer[i] = index;
+}
+
+void occupancy_unlink(struct map* m, int16_t* layer, int index)
+{
+	struct actor* a = &actors[index];
+	int16_t* p = &layer[map_index(m, a->x, a->y)];
+	while (*p != index) {
+		SDL_assert(*p != NO_ACTOR);
+		p = &actors[*p].next;
+	}
+	*p = a->next;
+}
+
+// moves a living actor and keeps the occupancy grid in sync
+void place_actor(struct map* m, struct actor* a, int x, int y)
+{
+	int index = (int)(a - actors);
+	occupancy_unlink(m, m->alive_at, index);
+	a->x = x;
+	a->y = y;
+	occupancy_link(m, m->alive_at, index);
+}
+
+void spawn_actor(struct map* m, enum actor_type type, int x, int y)
 {
 	if (num_actors < SDL_arraysize(actors)) {
-		actors[num_actors++] = (struct actor){ .type = type, .x = x, .y = y, .hp = actor_catalog[type].max_hp, .alive = 1 };
+		actors[num_actors] = (struct actor){ .type = type, .x = x, .y = y, .hp = actor_catalog[type].max_hp, .alive = 1 };
+		occupancy_link(m, m->alive_at, num_actors++);
 		SDL_Log("  Actor #%d : %s (%d/%d)", num_actors, actor_catalog[type].name, x, y);
 	}
 }
 
-void create_map()
+// room tries draw their size and position in bulk, this many at once
+#define ROOM_TRY_BATCH 256
+
+// bsp leaves are split until they are smaller than twice this
+#define BSP_MIN_LEAF_WIDTH 12
+#define BSP_MIN_LEAF_HEIGHT 8
+
+#define CAVE_WALL_PERCENT 45
+#define CAVE_STEPS 4
+
+#define DRUNKARD_FLOOR_PERCENT 40
+
+// caves and walks have no rooms, they get a monster per this many tiles
+#define FLOOR_TILES_PER_MONSTER 60
+
+// a level whose largest region is smaller than this is carved again with
+// the next draws, after that many tries it gets a single room instead
+#define GEN_MIN_REGION 24
+#define GEN_MAX_TRIES 8
+
+enum gen_stage {
+	GEN_STAGE_FILL,
+	GEN_STAGE_LAYOUT,
+	GEN_STAGE_CARVE,
+	GEN_STAGE_CONNECT,
+	GEN_STAGE_POPULATE,
+	NUM_GEN_STAGES
+};
+
+const char* gen_stage_names[NUM_GEN_STAGES] = {
+	"fill",
+	"layout",
+	"carve",
+	"connect",
+	"populate"
+};
+
+// actors placed by the level generator, the player comes first
+struct spawn {
+	enum actor_type type;
+	int x, y;
+};
+
+struct level_info {
+	int num_rooms;
+	int floor;     // floor tiles carved
+	int reachable; // of them in the largest region, the others are filled
+	Uint64 stage_ticks[NUM_GEN_STAGES];
+	int num_spawns;
+	struct spawn spawns[MAX_ACTORS];
+};
+
+// state passed through the stages while generating one level
+struct level_gen {
+	struct map* m;
+	struct level_info* info;
+	struct rng layout_rng, carve_rng, monster_rng;
+	struct room* rooms;
+	int num_rooms, room_capacity;
+	int* queue;    // one tile index per tile
+	uint8_t* seen; // one byte per tile, scratch until the connect stage
+	int* region;   // tile indices of the region that is kept
+	int region_size;
+};
+
+static void add_spawn(struct level_info* info, enum actor_type type, int x, int y)
 {
-	for (int y = 0; y < ROWS; y++) {
-		for (int x = 0; x < COLS; x++) {
-			if (x == 0 || y == 0 || x == COLS - 1 || y == ROWS - 1) {
-				map[y][x].type = TILE_TYPE_WALL;
-			}
-			else {
-				map[y][x].type = TILE_TYPE_FLOOR;
-			}
-		}
+	if (info->num_spawns < SDL_arraysize(info->spawns))
+		info->spawns[info->num_spawns++] = (struct spawn){ .type = type, .x = x, .y = y };
+}
+
+static void add_room(struct level_gen* gen, int x, int y, int w, int h)
+{
+	if (gen->num_rooms == gen->room_capacity) {
+		gen->room_capacity = maxi(gen->room_capacity * 2, 64);
+		gen->rooms = realloc(gen->rooms, gen->room_capacity * sizeof(struct room));
 	}
+	gen->rooms[gen->num_rooms++] = (struct room){ .ax = x, .ay = y, .bx = x + w, .by = y + h };
+}
 
-	for (int y = 0; y < ROWS; y++) {
-		for (int x = 0; x < COLS; x++) {
-			map[y][x].type = TILE_TYPE_WALL;
-			map[y][x].visible = 0;
-			map[y][x].explored = 0;
+void gen_fill(struct level_gen* gen)
+{
+	memset(gen->m->tiles, TILE_TYPE_WALL, (size_t)gen->m->width * gen->m->height * sizeof(struct map_tile));
+}
+
+// random rooms that do not intersect the ones before, every room reserves
+// its tiles and the wall right and below of it in a bitplane, so a try
+// tests a few words instead of all rooms
+void gen_layout_rooms(struct level_gen* gen)
+{
+	struct map* m = gen->m;
+	uint32_t tries[ROOM_TRY_BATCH][4];
+	uint64_t* reserved = calloc((size_t)m->stride * m->height, sizeof(uint64_t));
+
+	// room tries grow with the area, the default level gets MAX_ROOMS_PER_MAP
+	int max_rooms = (int)((int64_t)MAX_ROOMS_PER_MAP * m->width * m->height / (COLS * ROWS));
+	max_rooms = maxi(max_rooms, 1);
+
+	for (int n = 0; n < max_rooms; n++) {
+
+		if (n % ROOM_TRY_BATCH == 0)
+			rng_fill(&gen->layout_rng, tries[0], 4 * mini(max_rooms - n, ROOM_TRY_BATCH));
+		const uint32_t* r = tries[n % ROOM_TRY_BATCH];
+		int w = 6 + rng_bound(r[0], 5);
+		int h = 4 + rng_bound(r[1], 3);
+		if (w > m->width - 2 || h > m->height - 2)
+			continue;
+		int x = 1 + rng_bound(r[2], m->width - w - 1);
+		int y = 1 + rng_bound(r[3], m->height - h - 1);
+
+		if (!map_rect_any(m, reserved, x, y, x + w, y + h)) {
+			map_rect_set(m, reserved, x, y, x + w, y + h);
+			add_room(gen, x, y, w, h);
 		}
 	}
 
-	struct room rooms[MAX_ROOMS_PER_MAP];
-	int num_rooms = 0;
-	num_actors = 0;
-	num_messages = 0;
+	free(reserved);
+}
 
-	for (int n = 0; n < MAX_ROOMS_PER_MAP; n++) {
+// splits the map into leaves and puts a room into each, the rooms are in
+// depth first order so neighbours in the list are close on the map
+void gen_layout_bsp(struct level_gen* gen)
+{
+	struct map* m = gen->m;
+	struct room stack[64];
+	int top = 0;
+	stack[top++] = (struct room){ .ax = 1, .ay = 1, .bx = m->width - 1, .by = m->height - 1 };
+
+	while (top > 0) {
+		struct room leaf = stack[--top];
+		int lw = leaf.bx - leaf.ax, lh = leaf.by - leaf.ay;
+		bool split_x = lw >= 2 * BSP_MIN_LEAF_WIDTH, split_y = lh >= 2 * BSP_MIN_LEAF_HEIGHT;
+		if (split_x && split_y)
+			split_x = lw >= lh;
+
+		if ((split_x || split_y) && top + 2 <= SDL_arraysize(stack)) {
+			struct room a = leaf, b = leaf;
+			if (split_x)
+				a.bx = b.ax = leaf.ax + BSP_MIN_LEAF_WIDTH + random(&gen->layout_rng, lw - 2 * BSP_MIN_LEAF_WIDTH + 1);
+			else
+				a.by = b.ay = leaf.ay + BSP_MIN_LEAF_HEIGHT + random(&gen->layout_rng, lh - 2 * BSP_MIN_LEAF_HEIGHT + 1);
+			stack[top++] = b;
+			stack[top++] = a;
+			continue;
+		}
 
-		int w = random_range(6, 10);
-		int h = random_range(4, 6);
-		int x = random_range(1, COLS - w - 1);
-		int y = random_range(1, ROWS - h - 1);
+		// the room keeps a wall to the leaf border
+		if (lw < 8 || lh < 6)
+			continue;
+		int w = random_range(&gen->layout_rng, 6, mini(lw - 2, 12));
+		int h = random_range(&gen->layout_rng, 4, mini(lh - 2, 8));
+		int x = leaf.ax + 1 + random(&gen->layout_rng, lw - w - 1);
+		int y = leaf.ay + 1 + random(&gen->layout_rng, lh - h - 1);
+		add_room(gen, x, y, w, h);
+	}
+}
 
-		bool intersects = false;
-		for (int i = 0; i < num_rooms; i++) {
-			if (rooms[i].bx >= x && rooms[i].ax <= x + w && rooms[i].by >= y && rooms[i].ay <= y + h) {
-				intersects = true;
-				break;
-			}
-		}
+// carves a tunnel leg from (x, y) towards (tx, ty) and returns true when
+// it meets floor outside of the room it started from, that floor is
+// already connected to the rooms before
+static bool carve_leg(struct map* m, const struct room* from, int* x, int* y, int tx, int ty)
+{
+	while (*x != tx || *y != ty) {
+		if (*x != tx) *x += *x < tx ? 1 : -1;
+		else *y += *y < ty ? 1 : -1;
+
+		struct map_tile* t = map_tile(m, *x, *y);
+		if (t->type != TILE_TYPE_FLOOR)
+			t->type = TILE_TYPE_FLOOR;
+		else if (*x < from->ax || *x >= from->bx || *y < from->ay || *y >= from->by)
+			return true;
+	}
+	return false;
+}
 
-		if (!intersects) {
+// carves the rooms and an l-shaped tunnel from every room back to the one
+// before, the tunnel ends at the first floor it meets
+void gen_carve_rooms(struct level_gen* gen)
+{
+	struct map* m = gen->m;
+	for (int n = 0; n < gen->num_rooms; n++) {
+		struct room* room = &gen->rooms[n];
+		for (int y = room->ay; y < room->by; y++)
+			memset(map_tile(m, room->ax, y), TILE_TYPE_FLOOR, (room->bx - room->ax) * sizeof(struct map_tile));
+
+		if (n == 0)
+			continue;
+
+		struct room* prev_room = &gen->rooms[n - 1];
+
+		// prev center
+		int pcx = (prev_room->ax + prev_room->bx) / 2;
+		int pcy = (prev_room->ay + prev_room->by) / 2;
+
+		// new room center
+		int x = (room->ax + room->bx) / 2;
+		int y = (room->ay + room->by) / 2;
+
+		// tunnel first hor or vert (seen from the previous room)?
+		bool horizontal = random(&gen->carve_rng, 100) < 50;
+		if (horizontal) {
+			if (!carve_leg(m, room, &x, &y, x, pcy))
+				carve_leg(m, room, &x, &y, pcx, pcy);
+		}
+		else {
+			if (!carve_leg(m, room, &x, &y, pcx, y))
+				carve_leg(m, room, &x, &y, pcx, pcy);
+		}
+	}
+}
 
-			for (int j = 0; j < h; j++) {
-				for (int i = 0; i < w; i++) {
-					// if (j == 0) {
-					//     map[y + j - 1][x + i].type = TILE_TYPE_WALL;
-					// }
-					map[y + j][x + i].type = TILE_TYPE_FLOOR;
-				}
+// one cellular automaton step of the 4-5 rule: a wall stays with four or
+// more wall neighbours, any tile becomes wall with five, the border stays wall
+static void cave_step(const uint8_t* src, uint8_t* dst, int width, int height)
+{
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int i = y * width + x;
+			if (x == 0 || y == 0 || x == width - 1 || y == height - 1) {
+				dst[i] = TILE_TYPE_WALL;
+				continue;
 			}
+			int walls = 0;
+			for (int dy = -1; dy <= 1; dy++)
+				for (int dx = -1; dx <= 1; dx++)
+					walls += (dx || dy) && src[i + dy * width + dx] == TILE_TYPE_WALL;
+			int keep = src[i] == TILE_TYPE_WALL ? 4 : 5;
+			dst[i] = walls >= keep ? TILE_TYPE_WALL : TILE_TYPE_FLOOR;
+		}
+	}
+}
 
-			if (num_rooms == 0) {
-				spawn_actor(ACTOR_TYPE_PLAYER, x + w / 2, y + h / 2);
-			}
-			else {
-				struct room* prev_room = &rooms[num_rooms - 1];
+_Static_assert(sizeof(struct map_tile) == 1, "the last cave step writes the tiles as bytes");
 
-				// prev center
-				int pcx = (prev_room->ax + prev_room->bx) / 2;
-				int pcy = (prev_room->ay + prev_room->by) / 2;
+// random noise smoothed into caves, the queue and seen buffers are the
+// two generations, the last step writes the tiles
+void gen_carve_caves(struct level_gen* gen)
+{
+	struct map* m = gen->m;
+	int area = m->width * m->height;
+	uint8_t* a = gen->seen, * b = (uint8_t*)gen->queue;
+	uint32_t noise[ROOM_TRY_BATCH];
+	for (int i = 0; i < area; i++) {
+		if (i % ROOM_TRY_BATCH == 0)
+			rng_fill(&gen->carve_rng, noise, mini(area - i, ROOM_TRY_BATCH));
+		a[i] = rng_bound(noise[i % ROOM_TRY_BATCH], 100) < CAVE_WALL_PERCENT ? TILE_TYPE_WALL : TILE_TYPE_FLOOR;
+	}
 
-				// new room center
-				int ncx = x + w / 2;
-				int ncy = y + h / 2;
+	for (int step = 0; step < CAVE_STEPS; step++) {
+		cave_step(a, step == CAVE_STEPS - 1 ? (uint8_t*)m->tiles : b, m->width, m->height);
+		uint8_t* t = a; a = b; b = t;
+	}
+}
 
-				// tunnel first hor or vert?
-				bool horizontal = random(100) < 50;
+// a random walk from the center carves floor until enough is open
+void gen_carve_drunkard(struct level_gen* gen)
+{
+	struct map* m = gen->m;
+	int inner = (m->width - 2) * (m->height - 2);
+	int target = inner * DRUNKARD_FLOOR_PERCENT / 100, carved = 0;
+	int x = m->width / 2, y = m->height / 2;
+	uint32_t r = 0;
+
+	// two bits of random per step, the walk gives up after a while
+	for (int64_t step = 0; carved < target && step < (int64_t)inner * 50; step++) {
+		struct map_tile* t = map_tile(m, x, y);
+		if (t->type != TILE_TYPE_FLOOR) {
+			t->type = TILE_TYPE_FLOOR;
+			carved++;
+		}
+		if (step % 16 == 0)
+			r = rng_next(&gen->carve_rng);
+		switch (r & 3) {
+			case 0: x = mini(x + 1, m->width - 2); break;
+			case 1: x = maxi(x - 1, 1); break;
+			case 2: y = mini(y + 1, m->height - 2); break;
+			case 3: y = maxi(y - 1, 1); break;
+		}
+		r >>= 2;
+	}
+}
 
-				// coords
-				int kx, ky;
-				if (horizontal) {
-					kx = ncx;
-					ky = pcy;
-				}
-				else {
-					kx = pcx;
-					ky = ncy;
-				}
+// finds the connected floor regions and fills all but the largest, its
+// tiles are left in gen->region
+void gen_connect(struct level_gen* gen)
+{
+	struct map* m = gen->m;
+	int area = m->width * m->height;
+	int* queue = gen->queue;
+	size_t words = (size_t)m->stride * m->height;
+	memset(gen->seen, 0, area);
+	memset(m->walkable, 0, words * sizeof(uint64_t));
+	memset(m->transparent, 0, words * sizeof(uint64_t));
+
+	// every region is flooded into the queue after the ones before, the
+	// tile planes are built on the way: blocking tiles here, the walkable
+	// ones once it is known which of them stay
+	int tail = 0, best = 0, best_size = 0;
+	for (int start = 0; start < area; start++) {
+		struct tile_info* ti = &tiles[m->tiles[start].type];
+		if (!ti->walkable) {
+			if (ti->transparent)
+				map_set_bit(m, m->transparent, start % m->width, start / m->width);
+			continue;
+		}
+		if (gen->seen[start])
+			continue;
+
+		int first = tail, head = tail;
+		queue[tail++] = start;
+		gen->seen[start] = 1;
+		while (head < tail) {
+			int i = queue[head++];
+			int x = i % m->width;
+			int next[4] = { x > 0 ? i - 1 : -1, x < m->width - 1 ? i + 1 : -1, i - m->width, i + m->width };
+			for (int d = 0; d < 4; d++) {
+				int n = next[d];
+				if (n < 0 || n >= area || gen->seen[n] || !tiles[m->tiles[n].type].walkable)
+					continue;
+				gen->seen[n] = 1;
+				queue[tail++] = n;
+			}
+		}
 
-				for (;;) {
-					map[ky][pcx].type = TILE_TYPE_FLOOR;
-					if (pcx == ncx)
-						break;
-					if (pcx < ncx) pcx++; else pcx--;
-				};
-
-				for (;;) {
-					map[pcy][kx].type = TILE_TYPE_FLOOR;
-					if (pcy == ncy)
-						break;
-					if (pcy < ncy) pcy++; else pcy--;
-				}
+		if (tail - first > best_size) {
+			best = first;
+			best_size = tail - first;
+		}
+	}
 
+	for (int n = 0; n < tail; n++) {
+		int i = queue[n];
+		struct tile_info* ti;
+		if (n < best || n >= best + best_size) {
+			m->tiles[i].type = TILE_TYPE_WALL;
+			ti = &tiles[TILE_TYPE_WALL];
+		}
+		else
+			ti = &tiles[m->tiles[i].type];
+		if (ti->walkable)
+			map_set_bit(m, m->walkable, i % m->width, i / m->width);
+		if (ti->transparent)
+			map_set_bit(m, m->transparent, i % m->width, i / m->width);
+	}
 
-			}
+	gen->region = queue + best;
+	gen->region_size = best_size;
+	gen->info->floor = tail;
+	gen->info->reachable = best_size;
+}
 
-			rooms[num_rooms++] = (struct room){ .ax = x, .ay = y, .bx = x + w, .by = y + h };
-			SDL_Log("Room %d : %d/%d-%d/%d", num_rooms, x, y, w, h);
+// the player goes into the first room and up to two monsters into every
+// room, without rooms they are spread over the kept region
+void gen_populate(struct level_gen* gen)
+{
+	struct level_info* info = gen->info;
+	struct rng* rng = &gen->monster_rng;
+
+	if (gen->num_rooms > 0) {
+		for (int n = 0; n < gen->num_rooms; n++) {
+			struct room* room = &gen->rooms[n];
+			int w = room->bx - room->ax, h = room->by - room->ay;
+			if (n == 0)
+				add_spawn(info, ACTOR_TYPE_PLAYER, room->ax + w / 2, room->ay + h / 2);
 
-			// spawn monsters
-			int num_monsters = random(3);
+			int num_monsters = random(rng, 3);
 			for (int i = 0; i < num_monsters; i++) {
-				int ex = x + random(w);
-				int ey = y + random(h);
-				spawn_actor(random(100) < 80 ? ACTOR_TYPE_ORC : ACTOR_TYPE_TROLL, ex, ey);
+				int ex = room->ax + random(rng, w);
+				int ey = room->ay + random(rng, h);
+				add_spawn(info, random(rng, 100) < 80 ? ACTOR_TYPE_ORC : ACTOR_TYPE_TROLL, ex, ey);
 			}
 		}
 	}
+	else if (gen->region_size > 0) {
+		int width = gen->m->width;
+		int num_monsters = gen->region_size / FLOOR_TILES_PER_MONSTER;
+		for (int n = 0; n <= num_monsters; n++) {
+			int i = gen->region[random(rng, gen->region_size)];
+			enum actor_type type = n == 0 ? ACTOR_TYPE_PLAYER : random(rng, 100) < 80 ? ACTOR_TYPE_ORC : ACTOR_TYPE_TROLL;
+			add_spawn(info, type, i % width, i / width);
+		}
+	}
+
+	if (info->num_spawns == 0 || info->spawns[0].type != ACTOR_TYPE_PLAYER)
+		fatal("level generator placed no player");
 }
 
-void update_fov()
+enum level_generator_id {
+	LEVEL_GENERATOR_ROOMS,
+	LEVEL_GENERATOR_BSP,
+	LEVEL_GENERATOR_CAVES,
+	LEVEL_GENERATOR_DRUNKARD,
+	NUM_LEVEL_GENERATORS
+};
+
+// a generator is a function per stage, stages without one are skipped
+struct level_generator {
+	const char* name;
+	void (*stages[NUM_GEN_STAGES])(struct level_gen* gen);
+};
+
+// order must be same as level_generator_id!
+const struct level_generator level_generators[NUM_LEVEL_GENERATORS] = {
+	{ "rooms", { gen_fill, gen_layout_rooms, gen_carve_rooms, gen_connect, gen_populate } },
+	{ "bsp", { gen_fill, gen_layout_bsp, gen_carve_rooms, gen_connect, gen_populate } },
+	{ "caves", { NULL, NULL, gen_carve_caves, gen_connect, gen_populate } },
+	{ "drunkard", { gen_fill, NULL, gen_carve_drunkard, gen_connect, gen_populate } }
+};
+
+static enum level_generator_id level_generator = LEVEL_GENERATOR_ROOMS;
+
+// runs the stages of the level generator on the map and lists the actors,
+// the result depends on seed and level number alone and touches no globals,
+// so levels can be generated on several threads
+static void run_gen_stage(void (*stage_fn)(struct level_gen*), struct level_gen* gen, enum gen_stage stage)
 {
-	for (int y = 0; y < ROWS; y++) {
-		for (int x = 0; x < COLS; x++) {
-			map[y][x].visible = 0;
-		}
+	Uint64 start = SDL_GetPerformanceCounter();
+	if (stage_fn)
+		stage_fn(gen);
+	gen->info->stage_ticks[stage] += SDL_GetPerformanceCounter() - start;
+}
+
+void generate_level(struct map* m, uint64_t seed, uint32_t level_number, struct level_info* info)
+{
+	size_t area = (size_t)m->width * m->height;
+	struct level_gen gen = {
+		.m = m,
+		.info = info,
+		.layout_rng = rng_stream(seed, RNG_STREAM_LAYOUT, level_number),
+		.carve_rng = rng_stream(seed, RNG_STREAM_CARVE, level_number),
+		.monster_rng = rng_stream(seed, RNG_STREAM_MONSTERS, level_number),
+		.queue = malloc(area * sizeof(int)),
+		.seen = malloc(area)
+	};
+	info->num_rooms = info->num_spawns = 0;
+	info->floor = info->reachable = 0;
+	memset(info->stage_ticks, 0, sizeof(info->stage_ticks));
+
+	const struct level_generator* generator = &level_generators[level_generator];
+	for (int try = 0; try < GEN_MAX_TRIES && gen.region_size < GEN_MIN_REGION; try++) {
+		gen.num_rooms = 0;
+		for (int stage = 0; stage < GEN_STAGE_POPULATE; stage++)
+			run_gen_stage(generator->stages[stage], &gen, stage);
+	}
+
+	if (gen.region_size < GEN_MIN_REGION) {
+		int w = mini(m->width - 2, 10), h = mini(m->height - 2, 6);
+		gen.num_rooms = 0;
+		add_room(&gen, (m->width - w) / 2, (m->height - h) / 2, w, h);
+		gen_fill(&gen);
+		gen_carve_rooms(&gen);
+		gen_connect(&gen);
+	}
+	run_gen_stage(generator->stages[GEN_STAGE_POPULATE], &gen, GEN_STAGE_POPULATE);
+	info->num_rooms = gen.num_rooms;
+	free(gen.rooms);
+	free(gen.seen);
+	free(gen.queue);
+}
+
+// the level is a function of seed and level number alone
+void create_map(struct map* m, uint64_t seed, uint32_t level_number)
+{
+	static struct level_info info;
+	size_t words = (size_t)m->stride * m->height;
+	memset(m->visible, 0, words * sizeof(uint64_t));
+	memset(m->explored, 0, words * sizeof(uint64_t));
+	num_actors = 0;
+	clear_messages();
+	m->fov_x = m->fov_y = 0;
+	clear_occupancy(m);
+
+	generate_level(m, seed, level_number, &info);
+	for (int n = 0; n < info.num_spawns; n++)
+		spawn_actor(m, info.spawns[n].type, info.spawns[n].x, info.spawns[n].y);
+
+	SDL_Log("Level %dx%d (%s): %d rooms, %d of %d floor tiles reachable, %.1f KiB, path pools %.1f KiB", m->width, m->height,
+		level_generators[level_generator].name, info.num_rooms, info.reachable, info.floor, map_memory(m) / 1024.0,
+		GAME_PATH_POOLS * path_pool_memory(m) / 1024.0);
+}
+
+enum fov_algorithm {
+	FOV_ALGORITHM_SHADOWCAST,
+	FOV_ALGORITHM_RAYCAST,
+	NUM_FOV_ALGORITHMS
+};
+
+const char* fov_algorithm_names[NUM_FOV_ALGORITHMS] = {
+	"shadowcast",
+	"raycast"
+};
+
+static enum fov_algorithm fov_algorithm = FOV_ALGORITHM_SHADOWCAST;
+
+// clears the words around the last fov origin and moves it to (ox, oy),
+// nothing outside of that box can be visible
+void clear_fov(struct map* m, int ox, int oy)
+{
+	int ax = maxi(m->fov_x - VIEW_RADIUS, 0) >> 6, bx = mini(m->fov_x + VIEW_RADIUS, m->width - 1) >> 6;
+	int ay = maxi(m->fov_y - VIEW_RADIUS, 0), by = mini(m->fov_y + VIEW_RADIUS, m->height - 1);
+	for (int y = ay; y <= by; y++) {
+		uint64_t* row = &m->visible[y * m->stride];
+		for (int w = ax; w <= bx; w++)
+			row[w] = 0;
 	}
+	m->fov_x = ox;
+	m->fov_y = oy;
+}
+
+void update_fov_raycast(struct map* m)
+{
+	clear_fov(m, actors[0].x, actors[0].y);
 
 	for (int i = 0; i < 360 * 8; i++) {
 		float x = cosf((float)i * 0.01745f);
@@ -873,11 +2341,11 @@ void update_fov()
 		for (int j = 0; j < VIEW_RADIUS; j++) {
 			int mx = (int)ox;
 			int my = (int)oy;
-			if (!map_valid(mx, my))
+			if (!map_valid(m, mx, my))
 				break;
-			map[my][mx].visible = true;
-			map[my][mx].explored = true;
-			if (map[my][mx].type != TILE_TYPE_FLOOR)
+			map_set_bit(m, m->visible, mx, my);
+			map_set_bit(m, m->explored, mx, my);
+			if (!map_bit(m, m->transparent, mx, my))
 				break;
 			ox += x;
 			oy += y;
@@ -885,277 +2353,610 @@ void update_fov()
 	}
 }
 
+// slope as fraction n / d (d > 0)
+struct slope {
+	int n, d;
+};
+
+// octant transforms: dx = col * xx + row * xy, dy = col * yx + row * yy
+// octants are ordered around the origin; even octants start at an axis and
+// own the col == 0 tiles, odd octants start at a diagonal and own the
+// col == row tiles, so every tile is revealed by exactly one octant
+static const int octants[8][4] = {
+	{  0,  1,  1,  0 },
+	{  1,  0,  0,  1 },
+	{ -1,  0,  0,  1 },
+	{  0, -1,  1,  0 },
+	{  0, -1, -1,  0 },
+	{ -1,  0,  0, -1 },
+	{  1,  0,  0, -1 },
+	{  0,  1, -1,  0 }
+};
+
+int floor_div(int a, int b)
+{
+	return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+int ceil_div(int a, int b)
+{
+	return -floor_div(-a, b);
+}
+
+void reveal(struct map* m, int x, int y)
+{
+	map_set_bit(m, m->visible, x, y);
+	map_set_bit(m, m->explored, x, y);
+}
+
+// symmetric recursive shadowcasting over one octant (integer only)
+void cast_octant(struct map* m, int ox, int oy, int octant, int row, struct slope start, struct slope end)
+{
+	if (row > VIEW_RADIUS)
+		return;
+
+	const int* t = octants[octant];
+	// round_ties_up(row * start) .. round_ties_down(row * end)
+	int min_col = floor_div(2 * row * start.n + start.d, 2 * start.d);
+	int max_col = ceil_div(2 * row * end.n - end.d, 2 * end.d);
+	int prev = -1; // -1: none, 0: opaque, 1: transparent
+
+	for (int col = min_col; col <= max_col; col++) {
+		int x = ox + col * t[0] + row * t[1];
+		int y = oy + col * t[2] + row * t[3];
+		int transparent = map_transparent(m, x, y) ? 1 : 0;
+
+		bool owned = (octant & 1) ? col != 0 : col != row;
+		bool symmetric = col * start.d >= row * start.n && col * end.d <= row * end.n;
+		if (owned && (!transparent || symmetric) && map_valid(m, x, y) && col * col + row * row < VIEW_RADIUS * VIEW_RADIUS)
+			reveal(m, x, y);
+
+		if (prev == 0 && transparent)
+			start = (struct slope){ 2 * col - 1, 2 * row };
+		if (prev == 1 && !transparent)
+			cast_octant(m, ox, oy, octant, row + 1, start, (struct slope){ 2 * col - 1, 2 * row });
+		prev = transparent;
+	}
+
+	if (prev == 1)
+		cast_octant(m, ox, oy, octant, row + 1, start, end);
+}
+
+void update_fov_shadowcast(struct map* m)
+{
+	int ox = actors[0].x;
+	int oy = actors[0].y;
+	clear_fov(m, ox, oy);
+
+	reveal(m, ox, oy);
+	for (int octant = 0; octant < 8; octant++)
+		cast_octant(m, ox, oy, octant, 1, (struct slope){ 0, 1 }, (struct slope){ 1, 1 });
+}
+
+void update_fov(struct map* m)
+{
+	Uint64 span = trace_begin();
+	switch (fov_algorithm) {
+		case FOV_ALGORITHM_SHADOWCAST: update_fov_shadowcast(m); break;
+		case FOV_ALGORITHM_RAYCAST: update_fov_raycast(m); break;
+		default: SDL_assert(!"unknown fov algorithm"); update_fov_shadowcast(m); break;
+	}
+	trace_end("update_fov", span);
+}
+
 int heuristics(int ax, int ay, int bx, int by)
 {
 	return abs(bx - ax) + abs(ay - by);
 }
 
+enum path_algorithm {
+	PATH_ALGORITHM_DIJKSTRA,
+	PATH_ALGORITHM_ASTAR
+};
+
+// nodes are one per tile, so links are node indices and the position is
+// the index of the node
 struct path_node {
-	bool visited;
-	int distance;
-	int costs;
-	int prevx, prevy;
-	struct path_node* lnext;
-	int x;
-	int y;
+	uint32_t generation;
+	int32_t distance;
+	int32_t lnext, lprev; // queue links, -1 at the ends
+	uint8_t costs;
+	uint8_t bucket;       // queue bucket, the low bits of the priority
+	uint8_t prev;         // direction the way comes from, PATH_NO_PREV at the start
+	uint8_t visited : 1;
+	uint8_t target : 1;   // a search over all nodes may stop once all targets are popped
 };
 
-struct actor* get_alive_actor_at(int x, int y)
+#define PATH_NO_PREV 0xff
+
+// steps of the four directions, a node's prev direction points back
+static const int path_dirs[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+
+struct actor* get_alive_actor_at(struct map* m, int x, int y)
 {
-	for (int n = 0; n < num_actors; n++) {
-		struct actor* a = &actors[n];
-		if (a->alive && a->x == x && a->y == y)
-			return a;
-	}
-	return NULL;
+	int index = m->alive_at[map_index(m, x, y)];
+	return index != NO_ACTOR ? &actors[index] : NULL;
 }
 
-void path_udpate_node(struct path_node* v, struct path_node* u, int x, int y)
+void path_udpate_node(struct path_node* v, struct path_node* u, int prev_dir)
 {
 	if (!v->visited && v->costs > 0) {
 		int c = u->distance + v->costs;
 		if (c < v->distance) {
 			v->distance = c;
-			v->prevx = x;
-			v->prevy = y;
+			v->prev = (uint8_t)prev_dir;
 		}
 	}
 }
 
-bool find_path(int from_x, int from_y, int to_x, int to_y, int* first_x, int* first_y)
+// spawning may put up to three actors on the same tile
+#define PATH_MAX_COSTS 32
+
+// power of two, larger than the highest priority step (tile costs plus one
+// for the change of the A* heuristic)
+#define PATH_BUCKETS 64
+
+// nodes of a pool are not reset before a search: a node whose generation
+// differs from the pool is stale and gets reset on first access. The nodes
+// are laid out like the tiles of the map the pool searches.
+struct path_pool {
+	struct path_node* nodes;
+	struct map* map;
+	int width, height;
+	uint32_t generation;
+	int targets; // target nodes not popped yet
+};
+
+size_t path_pool_memory(const struct map* m)
 {
+	return (size_t)m->width * m->height * sizeof(struct path_node);
+}
 
-	struct path_node* v, * u, nodes[ROWS][COLS];
-	struct path_node* list = 0, ** q;
+// walkable tiles cost 1 to enter, tiles with living actors 10 more
+static inline struct path_node* path_node(struct path_pool* pool, int x, int y)
+{
+	int i = map_index(pool->map, x, y);
+	struct path_node* v = &pool->nodes[i];
+	if (v->generation != pool->generation) {
+		v->generation = pool->generation;
+		v->visited = 0;
+		v->target = 0;
+		v->distance = INT_MAX;
+		int costs = map_bit(pool->map, pool->map->walkable, x, y);
+		for (int k = pool->map->alive_at[i]; k != NO_ACTOR; k = actors[k].next)
+			costs = mini(costs + 10, PATH_MAX_COSTS);
+		v->costs = (uint8_t)costs;
+		v->prev = PATH_NO_PREV;
+	}
+	return v;
+}
 
-	for (int n = 0; n < ROWS * COLS; n++) {
-		int y = n / COLS;
-		int x = n % COLS;
-		nodes[y][x].visited = 0;
-		nodes[y][x].distance = INT_MAX;
-		nodes[y][x].costs = map_walkable(x, y) ? 1 : 0;
-		nodes[y][x].prevx = -1;
-		nodes[y][x].prevy = -1;
-		nodes[y][x].lnext = 0;
-		nodes[y][x].x = x;
-		nodes[y][x].y = y;
+// invalidates all nodes of the pool for a new search on map m, the nodes are
+// reallocated when the size of the map changed
+void path_begin(struct path_pool* pool, struct map* m)
+{
+	size_t area = (size_t)m->width * m->height;
+	if (pool->width != m->width || pool->height != m->height) {
+		free(pool->nodes);
+		pool->nodes = calloc(area, sizeof(struct path_node));
+		if (!pool->nodes) fatal("out of memory for path nodes %dx%d", m->width, m->height);
+		pool->width = m->width;
+		pool->height = m->height;
+		pool->generation = 0;
+		SDL_Log("path pool %dx%d: %.1f KiB", m->width, m->height, path_pool_memory(m) / 1024.0);
 	}
+	pool->map = m;
+	pool->targets = 0;
 
-	for (int n = 0; n < num_actors; n++) {
-		struct actor* a = &actors[n];
-		if (a->alive)
-			nodes[a->y][a->x].costs += 10;
+	if (++pool->generation == 0) {
+		memset(pool->nodes, 0, area * sizeof(struct path_node));
+		pool->generation = 1;
 	}
+}
 
-	int x = from_x;
-	int y = from_y;
-	nodes[y][x].distance = 0;
-	nodes[to_y][to_x].costs = 1;
+static uint64_t path_expansions;
+
+// bucket queue (dial's algorithm): tile costs are small integers, so the open
+// list is a ring of lists indexed by priority. All queued priorities are
+// within one priority step of the bucket cursor. Dijkstra pops ties in fifo
+// order; A* pops them lifo, which prefers the deeper node among equal f.
+struct path_queue {
+	struct path_node* nodes;
+	int32_t head[PATH_BUCKETS];
+	int32_t tail[PATH_BUCKETS];
+	int priority;
+	int size;
+	bool lifo;
+};
 
-	u = &nodes[y][x];
-	list = &nodes[y][x];
+void path_queue_init(struct path_queue* q, struct path_node* nodes, bool lifo)
+{
+	memset(q, 0, sizeof(*q));
+	q->nodes = nodes;
+	q->lifo = lifo;
+	for (int b = 0; b < PATH_BUCKETS; b++)
+		q->head[b] = q->tail[b] = -1;
+}
 
-	for (;;) {
+void path_queue_push(struct path_queue* q, int i, int priority)
+{
+	struct path_node* v = &q->nodes[i];
+	int b = priority & (PATH_BUCKETS - 1);
+	v->bucket = (uint8_t)b;
+	if (q->lifo && q->head[b] >= 0) {
+		v->lprev = -1;
+		v->lnext = q->head[b];
+		q->nodes[q->head[b]].lprev = i;
+		q->head[b] = i;
+	}
+	else {
+		v->lnext = -1;
+		v->lprev = q->tail[b];
+		if (q->tail[b] >= 0)
+			q->nodes[q->tail[b]].lnext = i;
+		else
+			q->head[b] = i;
+		q->tail[b] = i;
+	}
+	q->size++;
+}
 
-		if (!list) {
-			SDL_Log("no path found");
-			return false;
-		}
+void path_queue_remove(struct path_queue* q, int i)
+{
+	struct path_node* v = &q->nodes[i];
+	int b = v->bucket;
+	if (v->lprev >= 0)
+		q->nodes[v->lprev].lnext = v->lnext;
+	else
+		q->head[b] = v->lnext;
+	if (v->lnext >= 0)
+		q->nodes[v->lnext].lprev = v->lprev;
+	else
+		q->tail[b] = v->lprev;
+	q->size--;
+}
 
-		u = list;
-		list = list->lnext;
+// index of the node with the lowest priority or -1
+int path_queue_pop(struct path_queue* q)
+{
+	if (q->size == 0)
+		return -1;
 
-		x = u->x;
-		y = u->y;
+	while (q->head[q->priority & (PATH_BUCKETS - 1)] < 0)
+		q->priority++;
+
+	int i = q->head[q->priority & (PATH_BUCKETS - 1)];
+	path_queue_remove(q, i);
+	return i;
+}
+
+// dijkstra or A* from (from_x, from_y) until (to_x, to_y) is reached, returns
+// the goal node or NULL. With to_x < 0 (dijkstra only) every reachable node
+// gets its distance, or, if nodes were marked as targets, the search stops
+// after the last of them.
+struct path_node* path_search(struct path_pool* pool, int from_x, int from_y, int to_x, int to_y, enum path_algorithm algorithm)
+{
+	struct path_node* v, * u;
+	struct path_queue queue;
+	bool astar = algorithm == PATH_ALGORITHM_ASTAR;
+	SDL_assert(!astar || to_x >= 0);
+	path_queue_init(&queue, pool->nodes, astar);
+
+	int x = from_x;
+	int y = from_y;
+	u = path_node(pool, x, y);
+	u->distance = 0;
+	queue.priority = astar ? heuristics(x, y, to_x, to_y) : 0;
+	path_queue_push(&queue, map_index(pool->map, x, y), queue.priority);
+
+	int i;
+	while ((i = path_queue_pop(&queue)) >= 0) {
+
+		path_expansions++;
+
+		u = &pool->nodes[i];
+		x = i % pool->width;
+		y = i / pool->width;
 
 		if (x == to_x && y == to_y)
-			break;
+			return u;
+		if (u->target && --pool->targets == 0)
+			return u;
 
+		// blocked neighbours are rejected on the walkable plane without
+		// touching their nodes, only the goal may be entered regardless
 		for (int n = 0; n < 4; n++) {
-			v = 0;
+			int nx = x, ny = y;
 			switch (n) {
-				case 0: if (x > 0) v = &nodes[y][x - 1]; break;
-				case 1: if (x < COLS - 1); v = &nodes[y][x + 1]; break;
-				case 2: if (y > 0) v = &nodes[y - 1][x]; break;
-				case 3: if (y < ROWS - 1) v = &nodes[y + 1][x]; break;
+				case 0: if (x == 0) continue; nx--; break;
+				case 1: if (x == pool->width - 1) continue; nx++; break;
+				case 2: if (y == 0) continue; ny--; break;
+				case 3: if (y == pool->height - 1) continue; ny++; break;
 			}
+			if (!map_bit(pool->map, pool->map->walkable, nx, ny) && (nx != to_x || ny != to_y))
+				continue;
 
+			v = path_node(pool, nx, ny);
 			if (!v->visited && v->costs > 0) {
 				int c = u->distance + v->costs;
 				if (c < v->distance) {
+					int vi = (int)(v - pool->nodes);
+					if (v->distance != INT_MAX)
+						path_queue_remove(&queue, vi);
 					v->distance = c;
-					v->prevx = x;
-					v->prevy = y;
-
-					q = &list;
-					while (*q && (*q)->distance <= v->distance) {
-						q = &(*q)->lnext;
-					}
-					v->lnext = *q;
-					*q = v;
+					v->prev = (uint8_t)(n ^ 1);
+					path_queue_push(&queue, vi, astar ? c + heuristics(nx, ny, to_x, to_y) : c);
 				}
 			}
 		}
 
-		nodes[y][x].visited = 1;
+		u->visited = 1;
+	}
+
+	return NULL;
+}
+
+bool find_path(struct map* m, int from_x, int from_y, int to_x, int to_y, int* first_x, int* first_y)
+{
+	static struct path_pool pool;
+
+	Uint64 span = trace_begin();
+	path_begin(&pool, m);
+	path_node(&pool, to_x, to_y)->costs = 1;
+
+	struct path_node* u = path_search(&pool, from_x, from_y, to_x, to_y, PATH_ALGORITHM_ASTAR);
+	if (!u) {
+		trace_end("find_path", span);
+		SDL_Log("no path found");
+		return false;
 	}
 
 	// dump
 	// SDL_Log("\n\nDIJKSTRA\n");
 	// char s[COLS + 1];
-	// for (int n = 0; n < ROWS * COLS; n++) {
-	//     int y = n / COLS;
-	//     int x = n % COLS;
-	//     if (nodes[y][x].costs == 0) {
+	// for (int n = 0; n < m->height * m->width; n++) {
+	//     int y = n / m->width;
+	//     int x = n % m->width;
+	//     if (pool.nodes[n].costs == 0) {
 	//         s[x] = '#';
-	//     } else if (nodes[y][x].distance == INT_MAX) {
+	//     } else if (pool.nodes[n].distance == INT_MAX) {
 	//         s[x] = '?';
-	//     } else if (nodes[y][x].distance >= 10) {
+	//     } else if (pool.nodes[n].distance >= 10) {
 	//         s[x] = 'V';
 	//     } else {
-	//         s[x] = '0' + nodes[y][x].distance;
+	//         s[x] = '0' + pool.nodes[n].distance;
 	//     }
-	//     if (x == COLS - 1) {
-	//         s[COLS] = '\0';
+	//     if (x == m->width - 1) {
+	//         s[m->width] = '\0';
 	//         SDL_Log(s);
 	//     }
 	// }
 
 	// get first entry
-	while (u->prevx != from_x || u->prevy != from_y)
-		u = &nodes[u->prevy][u->prevx];
+	int x = to_x, y = to_y;
+	while (u->prev != PATH_NO_PREV) {
+		int px = x + path_dirs[u->prev][0], py = y + path_dirs[u->prev][1];
+		if (px == from_x && py == from_y)
+			break;
+		x = px;
+		y = py;
+		u = &pool.nodes[map_index(m, x, y)];
+	}
 
-	*first_x = u->x;
-	*first_y = u->y;
+	*first_x = x;
+	*first_y = y;
 
+	trace_end("find_path", span);
 	return true;
 }
 
-void actor_set_hp(struct actor* a, int hp)
+// reverse distance map: costs of the way from the tiles to the player,
+// computed once per turn and shared by all monsters
+static struct path_pool player_paths;
+
+// only visible monsters that are not next to the player step on the map, the
+// search ends when their tiles are reached. Their downhill neighbours are
+// popped before them and final, the others are not smaller than theirs.
+void update_player_distance(struct map* m)
+{
+	struct actor* player = &actors[0];
+	path_begin(&player_paths, m);
+	for (int n = 1; n < num_actors; n++) {
+		struct actor* a = &actors[n];
+		if (!a->alive || !map_bit(m, m->visible, a->x, a->y) || abs(player->x - a->x) + abs(player->y - a->y) <= 1)
+			continue;
+		struct path_node* v = path_node(&player_paths, a->x, a->y);
+		if (!v->target) {
+			v->target = 1;
+			player_paths.targets++;
+		}
+	}
+	path_search(&player_paths, player->x, player->y, -1, -1, PATH_ALGORITHM_DIJKSTRA);
+}
+
+int player_distance(int x, int y)
+{
+	struct path_node* v = &player_paths.nodes[map_index(player_paths.map, x, y)];
+	return v->generation == player_paths.generation ? v->distance : INT_MAX;
+}
+
+// next step downhill on the player distance map
+bool step_to_player(struct map* m, int from_x, int from_y, int* first_x, int* first_y)
+{
+	static const int dirs[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+
+	int best = INT_MAX;
+	for (int n = 0; n < 4; n++) {
+		int x = from_x + dirs[n][0];
+		int y = from_y + dirs[n][1];
+		if (map_valid(m, x, y) && player_distance(x, y) < best) {
+			best = player_distance(x, y);
+			*first_x = x;
+			*first_y = y;
+		}
+	}
+
+	return best != INT_MAX;
+}
+
+void actor_set_hp(struct map* m, struct actor* a, int hp)
 {
 	a->hp = maxi(mini(hp, actor_catalog[a->type].max_hp), 0);
-	if (a->hp == 0) {
+	if (a->hp == 0 && a->alive) {
 		a->alive = false;
-		char death_message[128];
-		struct color color;
+		occupancy_unlink(m, m->alive_at, (int)(a - actors));
+		occupancy_link(m, m->corpse_at, (int)(a - actors));
 		if (a->type == ACTOR_TYPE_PLAYER) {
-			snprintf(death_message, sizeof(death_message), "You died!");
-			color = player_die;
+			add_message(player_die, 1, MESSAGE_PLAYER_DIED);
 			g.state = GAME_STATE_DEAD;
 		}
 		else {
-			snprintf(death_message, sizeof(death_message), "%s is dead!", actor_catalog[a->type].name);
-			color = enemy_die;
+			add_message(enemy_die, 1, MESSAGE_ACTOR_DIED, a->type);
 		}
-		add_message(color, 1, death_message);
 	}
 }
 
-void execute_melee(struct actor* source, struct actor* target)
+void execute_melee(struct map* m, struct actor* source, struct actor* target)
 {
 	struct actor_info* source_info = &actor_catalog[source->type], * target_info = &actor_catalog[target->type];
 	int damage = source_info->power - target_info->defense;
-	char name[32], attack_desc[128];
-	const char* p = source_info->name;
-	int n;
-	for (n = 0; n < sizeof(name) - 1; n++)
-		name[n] = toupper(*p++);
-	name[n] = '\0';
-
 	struct color attack_color = source->type == ACTOR_TYPE_PLAYER ? player_atk : enemy_atk;
 
-	snprintf(attack_desc, sizeof(attack_desc), "%s attacks %s", name, target_info->name);
 	if (damage > 0) {
-		add_message(attack_color, 1, "%s for %d hit points.", attack_desc, damage);
-		actor_set_hp(target, target->hp - damage);
+		add_message(attack_color, 1, MESSAGE_ATTACK, source->type, target->type, damage);
+		actor_set_hp(m, target, target->hp - damage);
 	}
 	else {
-		add_message(attack_color, 1, "%s but does no damage.", attack_desc);
+		add_message(attack_color, 1, MESSAGE_ATTACK_NO_DAMAGE, source->type, target->type);
 	}
 }
 
-void move_actor(struct actor* a, int nx, int ny)
+void move_actor(struct map* m, struct actor* a, int nx, int ny)
 {
-	if (map_valid(nx, ny) && map_walkable(nx, ny)) {
-		struct actor* target = get_alive_actor_at(nx, ny);
+	if (map_valid(m, nx, ny) && map_walkable(m, nx, ny)) {
+		struct actor* target = get_alive_actor_at(m, nx, ny);
 		if (!target) {
-			a->x = nx;
-			a->y = ny;
+			place_actor(m, a, nx, ny);
 		}
 	}
 }
 
-void bump_player(enum direction dir)
+void bump_player(struct map* m, enum direction dir)
 {
 	struct actor* player = &actors[0];
 	int nx = player->x + (dir == DIR_RIGHT ? 1 : (dir == DIR_LEFT ? -1 : 0));
 	int ny = player->y + (dir == DIR_DOWN ? 1 : (dir == DIR_UP ? -1 : 0));
-	if (map_valid(nx, ny) && map_walkable(nx, ny)) {
-		struct actor* target = get_alive_actor_at(nx, ny);
+	if (map_valid(m, nx, ny) && map_walkable(m, nx, ny)) {
+		struct actor* target = get_alive_actor_at(m, nx, ny);
 		if (target) {
-			execute_melee(player, target);
+			execute_melee(m, player, target);
 			return;
 		}
-		player->x = nx;
-		player->y = ny;
+		place_actor(m, player, nx, ny);
 	}
 }
 
+// (re)creates the level, it is only reallocated when the level size changed
 void start_game()
 {
-	create_map();
-	update_fov();
-	add_message(welcome_text, 0, "Hello and welcome, adventurer, to yet another dungeon!");
+	if (level && (level->width != level_width || level->height != level_height)) {
+		map_destroy(level);
+		level = NULL;
+	}
+	if (!level)
+		level = map_create(level_width, level_height);
+
+	create_map(level, game_seed, num_levels++);
+	update_fov(level);
+	g.map_dirty = true;
+	add_message(welcome_text, 0, MESSAGE_WELCOME);
+}
+
+// accumulated performance counter ticks of the turn phases
+struct turn_stats {
+	Uint64 action;
+	Uint64 fov;
+	Uint64 path;
+	Uint64 ai;
+};
+
+static struct turn_stats turn_stats;
+
+Uint64 turn_ticks()
+{
+	return turn_stats.action + turn_stats.fov + turn_stats.path + turn_stats.ai;
 }
 
-void execute_action(bool (*action)(void* udata), void* udata)
+void execute_action(struct map* m, bool (*action)(struct map* m, void* udata), void* udata)
 {
-	if (!action(udata))
+	Uint64 action_start = SDL_GetPerformanceCounter();
+	if (!action(m, udata))
 		return;
 
 	// handle enemies
+	Uint64 ai_start = SDL_GetPerformanceCounter();
+	Uint64 path_ticks = 0;
 	struct actor* player = &actors[0];
+	bool distance_valid = false;
 	for (int n = 1; n < num_actors; n++) {
 
 		struct actor* a = &actors[n];
 
-		if (a->alive && map[a->y][a->x].visible) {
+		if (a->alive && map_bit(m, m->visible, a->x, a->y)) {
 			int distance = abs(player->x - a->x) + abs(player->y - a->y);
 			if (distance == 1) {
-				execute_melee(a, player);
+				execute_melee(m, a, player);
 			}
 			else {
+				if (!distance_valid) {
+					Uint64 path_start = SDL_GetPerformanceCounter();
+					update_player_distance(m);
+					path_ticks = SDL_GetPerformanceCounter() - path_start;
+					distance_valid = true;
+				}
 				int dx, dy;
-				if (find_path(a->x, a->y, player->x, player->y, &dx, &dy)) {
-					move_actor(a, dx, dy);
+				if (step_to_player(m, a->x, a->y, &dx, &dy)) {
+					move_actor(m, a, dx, dy);
 				}
 			}
 		}
 	}
 
-	update_fov();
+	Uint64 fov_start = SDL_GetPerformanceCounter();
+	update_fov(m);
+	Uint64 fov_end = SDL_GetPerformanceCounter();
+	turn_stats.action += ai_start - action_start;
+	turn_stats.path += path_ticks;
+	turn_stats.ai += fov_start - ai_start - path_ticks;
+	turn_stats.fov += fov_end - fov_start;
+	profile_record(PHASE_ACTION, ai_start - action_start);
+	profile_record(PHASE_AI, fov_start - ai_start - path_ticks);
+	if (distance_valid)
+		profile_record(PHASE_PATH, path_ticks);
+	trace_end("turn", action_start);
+	profile_record(PHASE_FOV, fov_end - fov_start);
+	g.map_dirty = true;
 }
 
-bool action_bump(void* p)
+bool action_bump(struct map* m, void* p)
 {
     struct point* dir = p;
     struct actor* player = &actors[0];
 	int32_t nx = dir->x, ny = dir->y;
 
-	if (map_valid(nx, ny) && map_walkable(nx, ny)) {
-		struct actor* target = get_alive_actor_at(nx, ny);
+	if (map_valid(m, nx, ny) && map_walkable(m, nx, ny)) {
+		struct actor* target = get_alive_actor_at(m, nx, ny);
 		if (target) {
-			execute_melee(player, target);
+			execute_melee(m, player, target);
 			return true;
 		}
-		player->x = nx;
-		player->y = ny;
+		place_actor(m, player, nx, ny);
 	}
 
 	return true;
 }
 
-bool action_wait(void* p)
+bool action_wait(struct map* m, void* p)
 {
 	// do nothing
 	return true;
@@ -1177,7 +2978,7 @@ void process_movement(const SDL_Event* ev)
 
 	if (nx != player->x || ny != player->y) {
 		struct point dir = { .x = nx, .y = ny };
-		execute_action(action_bump, &dir);
+		execute_action(level, action_bump, &dir);
 	}
 }
 
@@ -1193,11 +2994,19 @@ void process_wait_key(const SDL_Event* ev)
 	if (ev->type == SDL_KEYDOWN) {
 		SDL_Scancode sc = ev->key.keysym.scancode;
 		if (sc == SDL_SCANCODE_KP_5 || sc == SDL_SCANCODE_PERIOD) {
-			execute_action(action_wait, 0);
+			execute_action(level, action_wait, 0);
 		}
 	}
 }
 
+void set_frame_policy(enum frame_policy policy)
+{
+	g.frame_policy = policy;
+	SDL_RenderSetVSync(g.renderer, policy == FRAME_POLICY_VSYNC);
+	g.redraw = true;
+	SDL_Log("frame policy: %s", frame_policy_names[policy]);
+}
+
 void process_commands(const SDL_Event* ev)
 {
 	if (ev->type == SDL_KEYDOWN) {
@@ -1207,6 +3016,17 @@ void process_commands(const SDL_Event* ev)
 				break;
 			case 'v':
 				g.state = GAME_STATE_HISTORY_VIEWER;
+				g.redraw = true;
+				break;
+			case 'f':
+				set_frame_policy((g.frame_policy + 1) % NUM_FRAME_POLICIES);
+				break;
+			case 'p':
+				g.show_profiler = !g.show_profiler;
+				g.redraw = true;
+				break;
+			case 'd':
+				dump_profile("profile.csv");
 				break;
 		}
 	}
@@ -1214,6 +3034,7 @@ void process_commands(const SDL_Event* ev)
 
 void process_mouse(const SDL_Event* ev)
 {
+	int mx = g.mouse_x, my = g.mouse_y;
 	switch (ev->type) {
 		case SDL_WINDOWEVENT:
 			switch (ev->window.event) {
@@ -1239,6 +3060,8 @@ void process_mouse(const SDL_Event* ev)
 			}
 			break;
 	}
+	if (mx != g.mouse_x || my != g.mouse_y)
+		g.redraw = true;
 }
 
 void handle_game_running_state(const SDL_Event* ev)
@@ -1249,7 +3072,7 @@ void handle_game_running_state(const SDL_Event* ev)
 	process_commands(ev);
 	process_mouse(ev);
 	if (ev->type == SDL_USEREVENT_RENDER) {
-		render_map_set();
+		render_map_set(level);
 	}
 }
 
@@ -1257,20 +3080,22 @@ void handle_game_over_state(const SDL_Event* ev)
 {
 	process_quit(ev);
 	if (ev->type == SDL_USEREVENT_RENDER) {
-		render_map_set();
+		render_map_set(level);
 	}
 }
 
 void handle_hist_viewer_state(const SDL_Event* ev)
 {
 	static int cursor = 0;
+	int size = history_size();
 	if (ev->type == SDL_KEYDOWN) {
+		g.redraw = true;
 		switch (ev->key.keysym.scancode) {
 			case SDL_SCANCODE_ESCAPE:
 				g.state = GAME_STATE_RUN;
 				break;
 			case SDL_SCANCODE_UP:
-				if (cursor < num_messages - 1) {
+				if (cursor < size - 1) {
 					cursor++;
 				}
 				break;
@@ -1285,11 +3110,11 @@ void handle_hist_viewer_state(const SDL_Event* ev)
 				break;
 			case SDL_SCANCODE_PAGEUP:
 				cursor += 10;
-				if (cursor >= num_messages)
-					cursor = num_messages - 1;
+				if (cursor >= size)
+					cursor = size - 1;
 				break;
 			case SDL_SCANCODE_HOME:
-				cursor = num_messages - 1;
+				cursor = size - 1;
 				break;
 			case SDL_SCANCODE_END:
 				cursor = 0;
@@ -1298,7 +3123,7 @@ void handle_hist_viewer_state(const SDL_Event* ev)
 	}
 	if (ev->type == SDL_USEREVENT_RENDER) {
 		set_render_alpha(127);
-		render_map_set();
+		render_map_set(level);
 		set_render_alpha(255);
 		draw_frame(3, 3, COLS - 6, ROWS - 6, (SDL_Color) { 255, 255, 255, 255 }, (SDL_Color) { 127, 127, 127, 127 }, "Message history");
 		render_message_log(5, 5, COLS - 10, ROWS - 10, cursor);
@@ -1317,19 +3142,515 @@ void (*event_handlers[])(const SDL_Event*) = {
 //
 //}
 
+void dispatch_event(void (*eh)(const SDL_Event*), const SDL_Event* ev)
+{
+	switch (ev->type) {
+		case SDL_RENDER_TARGETS_RESET:
+		case SDL_RENDER_DEVICE_RESET:
+			// target textures lose their content on device/target resets
+			g.map_dirty = true;
+			break;
+		case SDL_WINDOWEVENT:
+			if (ev->window.event == SDL_WINDOWEVENT_EXPOSED)
+				g.redraw = true;
+			break;
+	}
+
+	// turns triggered by the event are profiled on their own
+	Uint64 start = SDL_GetPerformanceCounter(), turns = turn_ticks();
+	eh(ev);
+	g.input_ticks += SDL_GetPerformanceCounter() - start - (turn_ticks() - turns);
+}
+
+// runs both fov algorithms from every floor tile of the same maps
+void bench_fov(int num_maps)
+{
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	Uint64 ticks[NUM_FOV_ALGORITHMS] = { 0 };
+	uint64_t visible[NUM_FOV_ALGORITHMS] = { 0 };
+	uint64_t calls = 0;
+
+	struct map* m = map_create(level_width, level_height);
+
+	for (int seed = 1; seed <= num_maps; seed++) {
+		create_map(m, seed, 0);
+		struct actor player = actors[0];
+
+		for (int y = 0; y < m->height; y++) {
+			for (int x = 0; x < m->width; x++) {
+				if (!map_walkable(m, x, y))
+					continue;
+				actors[0].x = x;
+				actors[0].y = y;
+				for (int n = 0; n < NUM_FOV_ALGORITHMS; n++) {
+					fov_algorithm = n;
+					Uint64 start = SDL_GetPerformanceCounter();
+					update_fov(m);
+					ticks[n] += SDL_GetPerformanceCounter() - start;
+					// nothing outside of the view radius is visible
+					for (int vy = maxi(y - VIEW_RADIUS, 0); vy <= mini(y + VIEW_RADIUS, m->height - 1); vy++)
+						for (int vx = maxi(x - VIEW_RADIUS, 0); vx <= mini(x + VIEW_RADIUS, m->width - 1); vx++)
+							visible[n] += map_bit(m, m->visible, vx, vy);
+				}
+				calls++;
+			}
+		}
+
+		actors[0] = player;
+	}
+
+	map_destroy(m);
+
+	for (int n = 0; n < NUM_FOV_ALGORITHMS; n++) {
+		SDL_Log("fov %-10s: %llu calls, %.3f us/call, %.1f visible tiles/call", fov_algorithm_names[n], (unsigned long long)calls,
+			ticks[n] * 1000000.0 / freq / calls, (double)visible[n] / calls);
+	}
+}
+
+void random_floor(struct map* m, struct rng* r, int* x, int* y)
+{
+	do {
+		*x = random(r, m->width);
+		*y = random(r, m->height);
+	} while (!map_walkable(m, *x, *y));
+}
+
+// pathfinding micro benchmark: dijkstra distance fields, and dijkstra and A*
+// point to point searches between random floor tiles
+void bench_path(int num_maps)
+{
+	static struct path_pool pool;
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	Uint64 ticks[3] = { 0 };
+	uint64_t expansions[3] = { 0 }, searches[3] = { 0 };
+	const char* names[3] = { "field", "dijkstra", "astar" };
+	struct map* m = map_create(level_width, level_height);
+
+	for (int seed = 1; seed <= num_maps; seed++) {
+		create_map(m, seed, 0);
+		struct rng rng = rng_stream(seed, RNG_STREAM_BENCH, 0);
+
+		for (int n = 0; n < 200; n++) {
+			int fx, fy, tx, ty;
+			random_floor(m, &rng, &fx, &fy);
+			random_floor(m, &rng, &tx, &ty);
+
+			for (int kind = 0; kind < 3; kind++) {
+				path_expansions = 0;
+				Uint64 start = SDL_GetPerformanceCounter();
+				path_begin(&pool, m);
+				path_node(&pool, tx, ty)->costs = 1;
+				path_search(&pool, fx, fy, kind ? tx : -1, ty, kind == 2 ? PATH_ALGORITHM_ASTAR : PATH_ALGORITHM_DIJKSTRA);
+				ticks[kind] += SDL_GetPerformanceCounter() - start;
+				expansions[kind] += path_expansions;
+				searches[kind]++;
+			}
+		}
+	}
+
+	for (int kind = 0; kind < 3; kind++) {
+		double secs = (double)ticks[kind] / freq;
+		SDL_Log("path %-8s %dx%d: %llu searches, %.1f expansions/search, %.3f us/search, %.2f M expansions/s", names[kind], m->width, m->height,
+			(unsigned long long)searches[kind], (double)expansions[kind] / searches[kind], secs * 1000000.0 / searches[kind], expansions[kind] / secs / 1000000.0);
+	}
+
+	map_destroy(m);
+}
+
+// quad encoding micro benchmark: the table driven encoder against the
+// reference that computes positions, uvs and indices per quad
+void bench_quads(int num_frames)
+{
+	void (*encoders[2])(struct quad_batch*, uint32_t, int, int, int, SDL_Color) = { encode_quad_computed, encode_quad };
+	const char* names[2] = { "computed", "tables" };
+	struct quad_batch batches[2];
+	Uint64 freq = SDL_GetPerformanceFrequency();
+
+	init_quad_tables(TILE_WIDTH * 16, TILE_HEIGHT * 16);
+	for (int k = 0; k < 2; k++) {
+		init_quad_batch(&batches[k], SPRITE_QUADS);
+		Uint64 start = SDL_GetPerformanceCounter();
+		// one frame: a glyph quad for every window cell
+		for (int frame = 0; frame < num_frames; frame++) {
+			uint32_t slot = 0;
+			for (int y = 0; y < SCREEN_ROWS; y++) {
+				for (int x = 0; x < SCREEN_COLS; x++) {
+					SDL_Color color = { (uint8_t)x, (uint8_t)y, (uint8_t)frame, 255 };
+					encoders[k](&batches[k], slot++, x, y, x + y + frame, color);
+				}
+			}
+		}
+		double us = (SDL_GetPerformanceCounter() - start) * 1000000.0 / freq;
+		SDL_Log("quads %-8s: %d frames, %.2f quads/us, %.1f us/frame", names[k], num_frames, (double)num_frames * SPRITE_QUADS / us, us / num_frames);
+	}
+
+	// both encoders must produce the same batch
+	if (memcmp(batches[0].verts, batches[1].verts, SPRITE_QUADS * 4 * sizeof(SDL_Vertex)) ||
+		memcmp(batches[0].inds, batches[1].inds, SPRITE_QUADS * 6 * sizeof(uint16_t)))
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "quads: encoders differ");
+
+	for (int k = 0; k < 2; k++) {
+		free(batches[k].verts);
+		free(batches[k].inds);
+	}
+}
+
+// results of one seed of the map sweep
+struct sweep_result {
+	int rooms;
+	int actors;
+	int floor;
+	int reachable; // floor tiles in the region that is kept
+	uint64_t hash; // of tiles and actors
+	Uint64 stage_ticks[NUM_GEN_STAGES];
+};
+
+struct sweep {
+	int first_seed;
+	int num_seeds;
+	SDL_atomic_t next; // index of the next seed to generate
+	struct sweep_result* results;
+};
+
+int sweep_thread(void* udata)
+{
+	struct sweep* s = udata;
+	struct map* m = map_create(level_width, level_height);
+	size_t area = (size_t)m->width * m->height;
+	struct level_info* info = malloc(sizeof(struct level_info));
+
+	for (;;) {
+		int n = SDL_AtomicAdd(&s->next, 1);
+		if (n >= s->num_seeds)
+			break;
+
+		generate_level(m, s->first_seed + n, 0, info);
+
+		struct sweep_result* r = &s->results[n];
+		r->rooms = info->num_rooms;
+		r->actors = info->num_spawns;
+		r->floor = info->floor;
+		r->reachable = info->reachable;
+		memcpy(r->stage_ticks, info->stage_ticks, sizeof(r->stage_ticks));
+		r->hash = 14695981039346656037ull;
+		for (size_t i = 0; i < area; i++) {
+			r->hash = (r->hash ^ m->tiles[i].type) * 1099511628211ull;
+		}
+		for (int a = 0; a < info->num_spawns; a++) {
+			struct spawn* sp = &info->spawns[a];
+			r->hash = (r->hash ^ sp->type) * 1099511628211ull;
+			r->hash = (r->hash ^ (uint32_t)(sp->y * m->width + sp->x)) * 1099511628211ull;
+		}
+	}
+
+	free(info);
+	map_destroy(m);
+	return 0;
+}
+
+// generates the first level of num_seeds seeds on num_threads threads and
+// reports throughput, content statistics and a hash per seed
+void sweep_maps(int first_seed, int num_seeds, int num_threads)
+{
+	struct sweep s = { .first_seed = first_seed, .num_seeds = maxi(num_seeds, 1) };
+	s.results = calloc(s.num_seeds, sizeof(struct sweep_result));
+	num_threads = maxi(mini(num_threads, s.num_seeds), 1);
+	SDL_Thread** threads = malloc(num_threads * sizeof(SDL_Thread*));
+
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int t = 0; t < num_threads; t++) {
+		threads[t] = SDL_CreateThread(sweep_thread, "sweep", &s);
+		if (!threads[t]) fatal("could not create sweep thread: %s", SDL_GetError());
+	}
+	for (int t = 0; t < num_threads; t++)
+		SDL_WaitThread(threads[t], NULL);
+	double seconds = (double)(SDL_GetPerformanceCounter() - start) / freq;
+
+	// the combined hash of all seeds catches any change in generation
+	uint64_t hash = 14695981039346656037ull, rooms = 0, actors = 0;
+	int min_rooms = INT_MAX, max_rooms = 0;
+	double reachable = 0, min_reachable = 100;
+	Uint64 stage_ticks[NUM_GEN_STAGES] = { 0 };
+	for (int n = 0; n < s.num_seeds; n++) {
+		struct sweep_result* r = &s.results[n];
+		double pct = r->floor ? 100.0 * r->reachable / r->floor : 0;
+		SDL_Log("sweep seed %d: %d rooms, %d actors, %d floor tiles, %.1f%% reachable, hash %016llx",
+			first_seed + n, r->rooms, r->actors, r->floor, pct, (unsigned long long)r->hash);
+		hash = (hash ^ r->hash) * 1099511628211ull;
+		rooms += r->rooms;
+		actors += r->actors;
+		min_rooms = mini(min_rooms, r->rooms);
+		max_rooms = maxi(max_rooms, r->rooms);
+		reachable += pct;
+		min_reachable = pct < min_reachable ? pct : min_reachable;
+		for (int stage = 0; stage < NUM_GEN_STAGES; stage++)
+			stage_ticks[stage] += r->stage_ticks[stage];
+	}
+
+	SDL_Log("sweep: %d %s maps %dx%d on %d threads in %.1f ms, %.0f maps/s", s.num_seeds,
+		level_generators[level_generator].name, level_width, level_height, num_threads, seconds * 1000.0, s.num_seeds / seconds);
+	SDL_Log("sweep: rooms %.1f avg (%d-%d), actors %.1f avg, reachable floor %.1f%% avg (min %.1f%%), hash %016llx",
+		(double)rooms / s.num_seeds, min_rooms, max_rooms, (double)actors / s.num_seeds,
+		reachable / s.num_seeds, min_reachable, (unsigned long long)hash);
+	for (int stage = 0; stage < NUM_GEN_STAGES; stage++)
+		SDL_Log("sweep: %-8s %8.1f us/map", gen_stage_names[stage], stage_ticks[stage] * 1000000.0 / freq / s.num_seeds);
+
+	free(threads);
+	free(s.results);
+}
+
+// creates the first level of num_seeds seeds with every generator and
+// checks that each has a live player on floor, returns the failures
+int check_levels(int first_seed, int num_seeds)
+{
+	enum level_generator_id generator = level_generator;
+	int failures = 0;
+	if (!level)
+		level = map_create(level_width, level_height);
+
+	// every level logs its actors
+	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_WARN);
+
+	for (int n = 0; n < NUM_LEVEL_GENERATORS; n++) {
+		level_generator = n;
+		for (int seed = first_seed; seed < first_seed + num_seeds; seed++) {
+			create_map(level, seed, 0);
+			struct actor* player = &actors[0];
+			if (num_actors == 0 || player->type != ACTOR_TYPE_PLAYER || !player->alive ||
+				!map_walkable(level, player->x, player->y)) {
+				SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION, "check: %s seed %d has no live player on floor", level_generators[n].name, seed);
+				failures++;
+			}
+		}
+	}
+
+	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO);
+	level_generator = generator;
+
+	SDL_Log("check: %d levels %dx%d per generator, %d failed", num_seeds, level_width, level_height, failures);
+	return failures;
+}
+
+// soak bot: attacks adjacent monsters, otherwise walks to a random floor
+// tile and sometimes just waits
+void soak_bot_turn(struct map* m, uint32_t* bot_seed, struct point* target)
+{
+	struct actor* player = &actors[0];
+	*bot_seed = *bot_seed * 1103515245 + 12345;
+	uint32_t r = *bot_seed >> 16;
+
+	static const int dirs[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	for (int n = 0; n < 4; n++) {
+		struct point p = { .x = player->x + dirs[n][0], .y = player->y + dirs[n][1] };
+		if (map_valid(m, p.x, p.y) && get_alive_actor_at(m, p.x, p.y)) {
+			execute_action(m, action_bump, &p);
+			return;
+		}
+	}
+
+	struct point p;
+	if (r % 10 == 0 || (player->x == target->x && player->y == target->y) ||
+		!find_path(m, player->x, player->y, target->x, target->y, &p.x, &p.y)) {
+		do {
+			target->x = (r = r * 1103515245 + 12345) % m->width;
+			target->y = (r = r * 1103515245 + 12345) % m->height;
+		} while (!map_walkable(m, target->x, target->y));
+		execute_action(m, action_wait, 0);
+		return;
+	}
+
+	execute_action(m, action_bump, &p);
+}
+
+// plays games_per_seed games for each seed with the soak bot and reports
+// turn throughput, turn latency and the time spent in the turn phases
+void run_soak(int games_per_seed, int num_seeds, int max_turns)
+{
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	int capacity = 4096, num_turns = 0, deaths = 0, kills = 0;
+	Uint64* latency = malloc(capacity * sizeof(Uint64));
+	Uint64 bot_ticks = 0;
+	memset(&turn_stats, 0, sizeof(turn_stats));
+
+	// every new game logs its level and actors
+	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_WARN);
+
+	for (int seed = 1; seed <= num_seeds; seed++) {
+		seed_game(seed);
+		for (int game = 0; game < games_per_seed; game++) {
+			start_game();
+			g.state = GAME_STATE_RUN;
+			uint32_t bot_seed = seed * 7919 + game;
+			struct point target = { actors[0].x, actors[0].y };
+
+			for (int turn = 0; turn < max_turns && g.state == GAME_STATE_RUN; turn++) {
+				Uint64 start = SDL_GetPerformanceCounter();
+				Uint64 turn_before = turn_ticks();
+				soak_bot_turn(level, &bot_seed, &target);
+				Uint64 end = SDL_GetPerformanceCounter();
+				Uint64 ticks = turn_ticks() - turn_before;
+				bot_ticks += end - start - ticks;
+
+				if (num_turns == capacity) {
+					capacity *= 2;
+					latency = realloc(latency, capacity * sizeof(Uint64));
+				}
+				latency[num_turns++] = ticks;
+			}
+
+			deaths += g.state == GAME_STATE_DEAD;
+			for (int n = 1; n < num_actors; n++)
+				kills += !actors[n].alive;
+		}
+	}
+
+	SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO);
+
+	if (num_turns == 0) {
+		free(latency);
+		return;
+	}
+
+	qsort(latency, num_turns, sizeof(Uint64), compare_ticks);
+	Uint64 total = turn_ticks();
+	double us = 1000000.0 / freq;
+
+	SDL_Log("soak: %d games, %d turns, %d player deaths, %d monsters killed", games_per_seed * num_seeds, num_turns, deaths, kills);
+	SDL_Log("soak: %.0f turns/s, turn latency p50 %.2f us, p99 %.2f us, max %.2f us", num_turns / (total * us / 1000000.0),
+		latency[num_turns / 2] * us, latency[mini(num_turns - 1, num_turns * 99 / 100)] * us, latency[num_turns - 1] * us);
+	SDL_Log("soak: action %.2f us/turn (%.1f%%), fov %.2f us/turn (%.1f%%), path %.2f us/turn (%.1f%%), ai %.2f us/turn (%.1f%%), bot %.2f us/turn",
+		turn_stats.action * us / num_turns, turn_stats.action * 100.0 / total,
+		turn_stats.fov * us / num_turns, turn_stats.fov * 100.0 / total,
+		turn_stats.path * us / num_turns, turn_stats.path * 100.0 / total,
+		turn_stats.ai * us / num_turns, turn_stats.ai * 100.0 / total,
+		bot_ticks * us / num_turns);
+
+	free(latency);
+}
+
+int int_arg(int argc, char* argv[], int i, int default_value)
+{
+	if (i >= argc || !isdigit(argv[i][0]))
+		return default_value;
+	// strtol saturates where atoi would overflow
+	long value = strtol(argv[i], NULL, 10);
+	return value > INT_MAX ? INT_MAX : (int)value;
+}
+
+void init_headless()
+{
+	if (SDL_Init(SDL_INIT_TIMER) != 0)
+		fatal("SDL_Init failed: %s\n", SDL_GetError());
+}
+
 int main(int argc, char* argv[])
 {
 	SDL_SetHint(SDL_HINT_VIDEO_HIGHDPI_DISABLED, "1");
 
+#ifndef ROQUEST_HEADLESS
+	enum frame_policy frame_policy = FRAME_POLICY_EVENT_DRIVEN;
+	const char* journal_path = "messages.journal";
+#endif
+	for (int i = 1; i < argc; i++) {
+#ifndef ROQUEST_HEADLESS
+		// window and journal options mean nothing to the headless build
+		if (!strcmp(argv[i], "--event-driven"))
+			frame_policy = FRAME_POLICY_EVENT_DRIVEN;
+		else if (!strcmp(argv[i], "--vsync"))
+			frame_policy = FRAME_POLICY_VSYNC;
+		else if (!strcmp(argv[i], "--fps-cap"))
+			frame_policy = FRAME_POLICY_FPS_CAP;
+		else if (!strcmp(argv[i], "--journal") && i + 1 < argc)
+			journal_path = argv[++i];
+		else
+#endif
+		if (!strcmp(argv[i], "--fov-raycast"))
+			fov_algorithm = FOV_ALGORITHM_RAYCAST;
+		else if (!strcmp(argv[i], "--fov-shadowcast"))
+			fov_algorithm = FOV_ALGORITHM_SHADOWCAST;
+		else if (!strcmp(argv[i], "--generator") && i + 1 < argc) {
+			// must come before the bench and soak options
+			const char* name = argv[++i];
+			for (int n = 0; n < NUM_LEVEL_GENERATORS; n++)
+				if (!strcmp(level_generators[n].name, name))
+					level_generator = n;
+		}
+		else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+			trace_start(argv[++i]);
+		else if (!strcmp(argv[i], "--level")) {
+			// must come before the bench and soak options
+			level_width = mini(maxi(int_arg(argc, argv, i + 1, COLS), 16), MAX_LEVEL_SIDE);
+			level_height = mini(maxi(int_arg(argc, argv, i + 2, ROWS), 10), MAX_LEVEL_SIDE);
+		}
+		else if (!strcmp(argv[i], "--bench-fov")) {
+			init_headless();
+			bench_fov(int_arg(argc, argv, i + 1, 10));
+			trace_stop();
+			SDL_Quit();
+			return 0;
+		}
+		else if (!strcmp(argv[i], "--bench-path")) {
+			init_headless();
+			bench_path(int_arg(argc, argv, i + 1, 50));
+			trace_stop();
+			SDL_Quit();
+			return 0;
+		}
+		else if (!strcmp(argv[i], "--bench-quads")) {
+			init_headless();
+			bench_quads(int_arg(argc, argv, i + 1, 2000));
+			trace_stop();
+			SDL_Quit();
+			return 0;
+		}
+		else if (!strcmp(argv[i], "--sweep-maps")) {
+			init_headless();
+			sweep_maps(int_arg(argc, argv, i + 1, 1), int_arg(argc, argv, i + 2, 1000), int_arg(argc, argv, i + 3, SDL_GetCPUCount()));
+			trace_stop();
+			SDL_Quit();
+			return 0;
+		}
+		else if (!strcmp(argv[i], "--check-levels")) {
+			init_headless();
+			int failures = check_levels(int_arg(argc, argv, i + 1, 1), int_arg(argc, argv, i + 2, 1000));
+			trace_stop();
+			SDL_Quit();
+			return failures ? 1 : 0;
+		}
+		else if (!strcmp(argv[i], "--soak")) {
+			init_headless();
+			run_soak(int_arg(argc, argv, i + 1, 10), int_arg(argc, argv, i + 2, 10), int_arg(argc, argv, i + 3, 1000));
+			trace_stop();
+			SDL_Quit();
+			return 0;
+		}
+	}
+
+#ifdef ROQUEST_HEADLESS
+	// the headless build never opens a window, without arguments it soaks
+	init_headless();
+	run_soak(10, 10, 1000);
+	trace_stop();
+	SDL_Quit();
+	return 0;
+#else
+
 	if (SDL_Init(SDL_INIT_TIMER | SDL_INIT_AUDIO | SDL_INIT_EVENTS | SDL_INIT_VIDEO) != 0)
 		fatal("SDL_Init failed: %s\n", SDL_GetError());
 
 	g.window = SDL_CreateWindow("roquest", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN);
 	if (!g.window) fatal("Could not create window: %s\n", SDL_GetError());
 
-	g.renderer = SDL_CreateRenderer(g.window, -1, 0);
+	g.renderer = SDL_CreateRenderer(g.window, -1, SDL_RENDERER_TARGETTEXTURE);
 	if (!g.renderer) fatal("could not create sdl renderer: %s", SDL_GetError());
 
+	g.map_layer = SDL_CreateTexture(g.renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, MAP_LAYER_WIDTH, MAP_LAYER_HEIGHT);
+	if (!g.map_layer) fatal("could not create map layer texture: %s", SDL_GetError());
+	SDL_SetTextureBlendMode(g.map_layer, SDL_BLENDMODE_BLEND);
+
+	set_frame_policy(frame_policy);
+
 	SDL_USEREVENT_NOTHING = SDL_RegisterEvents(2);
 	if (SDL_USEREVENT_NOTHING == -1) fatal("could not create render event");
 	SDL_USEREVENT_RENDER = SDL_USEREVENT_NOTHING + 1;
@@ -1338,38 +3659,85 @@ int main(int argc, char* argv[])
 	g.font = load_image("Bm437_Rainbow100_re_40.png", &fw, &fh);
 	SDL_assert(fw == TILE_WIDTH * 16 && fh == TILE_HEIGHT * 16);
 
-	random_seed = 1;
+	init_quad_tables(fw, fh);
+	init_quad_batch(&g_map_batch, MAP_QUADS);
+	init_quad_batch(&g_sprites, SPRITE_QUADS);
+	init_bg_layer(&g_map_bg, COLS, ROWS);
+	init_bg_layer(&g_ui_bg, SCREEN_COLS, SCREEN_ROWS);
+
+	journal_open(journal_path);
+	seed_game(1);
 	start_game();
+	invalidate_map_cells();
 
 	g.state = GAME_STATE_RUN;
 	g.quit_requested = false;
 	g.mouse_x = g.mouse_y = -1;
 	g.start_ticks = g.last_ticks = SDL_GetTicks64();
+	g.redraw = true;
 
 	Uint64 freq = SDL_GetPerformanceFrequency();
+	Uint64 next_frame = SDL_GetPerformanceCounter();
+	Uint64 stats_ticks = g.start_ticks;
+	double stats_cpu = cpu_time_ms();
+	float cpu_per_sec = 0.0f;
+	int frames = 0, fps = 0;
 	while (!g.quit_requested) {
 
 		void (*eh)(const SDL_Event * ev) = event_handlers[g.state];
 		SDL_assert(eh);
 
 		SDL_Event ev;
+		if (g.frame_policy == FRAME_POLICY_EVENT_DRIVEN && !g.redraw && !g.map_dirty) {
+			// sleep until something happens, but wake up for the stats overlay
+			Uint64 elapsed = SDL_GetTicks64() - stats_ticks;
+			int timeout = elapsed < STATS_INTERVAL_MS ? (int)(STATS_INTERVAL_MS - elapsed) : 0;
+			if (SDL_WaitEventTimeout(&ev, timeout))
+				dispatch_event(eh, &ev);
+		}
 		while (SDL_PollEvent(&ev)) {
-			eh(&ev);
+			dispatch_event(eh, &ev);
+		}
+
+		Uint64 ticks = SDL_GetTicks64();
+		if (ticks - stats_ticks >= STATS_INTERVAL_MS) {
+			double cpu = cpu_time_ms();
+			cpu_per_sec = (float)((cpu - stats_cpu) * 1000.0 / (ticks - stats_ticks));
+			fps = (int)(frames * 1000 / (ticks - stats_ticks));
+			stats_cpu = cpu;
+			stats_ticks = ticks;
+			frames = 0;
+			g.redraw = true;
 		}
 
+		if (g.frame_policy == FRAME_POLICY_EVENT_DRIVEN && !g.redraw && !g.map_dirty)
+			continue;
+		g.redraw = false;
+
+		profile_record(PHASE_INPUT, g.input_ticks);
+		g.input_ticks = 0;
+
 		static float krms;
 		Uint64 rs = SDL_GetPerformanceCounter();
-		g_num_sprites = 0;
+		g_num_sprites = g_num_flushes = 0;
+		g_submit_ticks = 0;
 		SDL_SetRenderDrawColor(g.renderer, 0, 0, 0, 255);
 		SDL_RenderClear(g.renderer);
 		ev.type = SDL_USEREVENT_RENDER;
 		eh(&ev);
-		draw_text(0, 0, white, "%.2f (Quads: %d)", krms, g_num_sprites);
-		SDL_RenderGeometryRaw(g.renderer, g.font, &g_verts[0].position.x, sizeof(g_verts[0]),
-			&g_verts[0].color, sizeof(g_verts[0]), &g_verts[0].tex_coord.x, sizeof(g_verts[0]),
-			g_num_sprites * 4, g_inds, g_num_sprites * 6, sizeof(g_inds[0]));
+		draw_text(0, 0, white, "%.2f (Quads: %d in %d draws, Cells: %d, %s: %d fps, CPU: %.0f ms/s)", krms, g_num_sprites, g_num_flushes + 1, g_cells_encoded,
+			frame_policy_names[g.frame_policy], fps, cpu_per_sec);
+		if (g.show_profiler)
+			render_profiler();
+		flush_sprites();
+		Uint64 present_start = SDL_GetPerformanceCounter();
 		SDL_RenderPresent(g.renderer);
 		Uint64 re = SDL_GetPerformanceCounter();
+		trace_end("frame", rs);
+		profile_record(PHASE_BUILD, present_start - rs - g_submit_ticks);
+		profile_record(PHASE_SUBMIT, g_submit_ticks);
+		profile_record(PHASE_PRESENT, re - present_start);
+		frames++;
 
 		float rdiff = ((re - rs) * 1000.0f) / freq;
 		static float rms = 0;
@@ -1381,16 +3749,22 @@ int main(int argc, char* argv[])
 			interval = 0.0f;
 		}
 
-		//// save some processor power
-		//Uint64 ticks = SDL_GetTicks64();
-		//if (ticks - g.last_ticks <= 10) {
-		//	SDL_Delay(1);
-		//}
-		//g.last_ticks = ticks;
+		// save some processor power
+		if (g.frame_policy == FRAME_POLICY_FPS_CAP) {
+			next_frame += freq / FPS_CAP;
+			Uint64 now = SDL_GetPerformanceCounter();
+			if (now < next_frame)
+				SDL_Delay((Uint32)((next_frame - now) * 1000 / freq));
+			else
+				next_frame = now;
+		}
 	}
 
 	SDL_DestroyWindow(g.window);
 
+	journal_stop();
+	trace_stop();
 	SDL_Quit();
 	return 0;
+#endif
 }
\ No newline at end of file